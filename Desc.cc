@@ -2,7 +2,7 @@
  *  $Id$
  */
 #include "Object++_.h"
-#include <stdarg.h>
+#include <algorithm>
 
 namespace TU
 {
@@ -10,81 +10,187 @@ namespace TU
 *  Object::Desc: table for constructors of objects associated with	*
 *		   classID						*
 ************************************************************************/
-Object::Desc::Desc(u_short id, u_short bid, Pftype ctor, ...)
-    :_id(id), _bid(bid), _pf(ctor), _p(0), _init(_bid == 0)
+Object::Desc::~Desc()
+{
+    if (_id < _ntbl && _tbl[_id] == this)
+	_tbl[_id] = 0;
+    if (--_ndescs == 0)
+    {
+	delete [] _tbl;
+	_tbl  = 0;
+	_ntbl = 0;
+    }
+}
+
+//! 自身を登録し，基底クラスのメンバを併合する
+/*!
+  クラスIDをindexとする表に自身を登録する．基底クラスが既に登録されて
+  いれば直ちにそのメンバを併合し，まだならば基底クラスが登録されるまで
+  待ち行列に入る．また，自身を基底クラスとして待っていたDescのメンバも
+  併合する．
+*/
+void
+Object::Desc::setup()
 {
 #ifdef TUObjectPP_DEBUG
     std::cerr << "Desc::Desc(): myId = " << _id << ", baseId = " << _bid
 	      << std::endl;
 #endif
-    if (_ndescs++ == 0)
-	_map = new Map;
-    (*_map)[_id] = this;
+    ++_ndescs;
+    if (_id >= _ntbl)				// Extend the table.
+    {
+	u_int	ntbl = (_ntbl == 0 ? 256 : _ntbl);
+	while (ntbl <= _id)
+	    ntbl *= 2;
+	Desc**	tbl = new Desc*[ntbl];
+	for (u_int i = 0; i < ntbl; ++i)
+	    tbl[i] = (i < _ntbl ? _tbl[i] : 0);
+	delete [] _tbl;
+	_tbl  = tbl;
+	_ntbl = ntbl;
+    }
+#ifdef TUObjectPP_DEBUG
+    if (_tbl[_id] != 0)
+	std::cerr << "  class ID " << _id << " is already used!!" << std::endl;
+#endif
+    _tbl[_id] = this;
 
-    u_int       i = 0;
-    va_list     args;
-    va_start(args, ctor);
-    for (Mbrp q; (q = va_arg(args, Mbrp)) != 0; )
-	++i;
-    va_end(args);
 #ifdef TUObjectPP_DEBUG
-    std::cerr << "  " << i << " members found..." << std::endl;
+    std::cerr << "  " << _slot.size() << " members found..." << std::endl;
 #endif
-    _p = new Mbrp[i+1];
-    va_start(args, ctor);
-    for (i = 0; (_p[i] = va_arg(args, Mbrp)) != 0; )
-	++i;
-    va_end(args);
+    _slot.push_back(0);				// terminator
+    bitmap();
+
+    if (_bid == 0)
+	_init = true;
+    else if (_bid < _ntbl && _tbl[_bid] != 0 && _tbl[_bid]->_init)
+	merge(*_tbl[_bid]);
+    else					// Wait for the base.
+    {
+	_nxt	 = _pending;
+	_pending = this;
+	return;
+    }
 
-    for (Map::iterator i = _map->begin(); i != _map->end(); ++i)
+  // Complete the descendants waiting for me.
+    for (Desc* desc = this; desc != 0; )
     {
+	Desc**	q = &_pending;
+	while (*q != 0 && (*q)->_bid != desc->_id)
+	    q = &(*q)->_nxt;
+	if (*q == 0)				// No more children of desc.
+	    desc = (desc == this ? 0 : _tbl[desc->_bid]);
+	else
+	{
+	    Desc*	child = *q;
+	    *q = child->_nxt;			// Remove child from the queue.
+	    child->merge(*desc);
+	    desc = child;			// Then complete grandchildren.
+	}
+    }
+}
+
+//! 基底クラスのメンバを自身のメンバの前に併合する
+void
+Object::Desc::merge(const Desc& base)
+{
 #ifdef TUObjectPP_DEBUG
-        std::cerr << "  setting pointers to member functions of class "
-		  << (*i).first << "..." << std::endl;
+    std::cerr << "  merging members of class " << base._id
+	      << " into class " << _id << "..." << std::endl;
 #endif
-	(*i).second->setMbrp();
-    }
+    _slot.insert(_slot.begin(), base._slot.begin(), base._slot.end() - 1);
+    _arr.insert(_arr.begin(), base._arr.begin(), base._arr.end());
+    std::vector<Guts>	guts;
+    guts.swap(_guts);
+    for (size_t i = 0; i < base._guts.size(); ++i)
+	add(base._guts[i]);
+    for (size_t i = 0; i < guts.size(); ++i)
+	add(guts[i]);
+    std::stable_partition(_arr.begin(), _arr.end(),	// trailing one last
+			  [](const Counted& arr){return !arr.trailing;});
+    _init = true;
+    _nxt  = 0;
+    bitmap();
 }
 
-Object::Desc::~Desc()
+//! 要素数を伴うポインタ配列を登録する
+/*!
+  末尾に置かれる配列はオブジェクトの大きさを決めるので，1つのクラスに
+  高々1つしか登録できない．
+*/
+void
+Object::Desc::add(const Counted& arr)
 {
-    delete [] _p;
-    if (--_ndescs == 0)
-	delete _map;
+    if (arr.trailing && variable())
+	throw std::domain_error("TU::Object::Desc::add\tMultiple trailing arrays!!");
+    if (arr.trailing)
+	_arr.push_back(arr);
+    else
+	_arr.insert(std::find_if(_arr.begin(), _arr.end(),
+				 [](const Counted& a){return a.trailing;}),
+		    arr);
 }
 
-u_int
-Object::Desc::nMbrp() const
+//! そのままのbyte列として保存，復元される非ポインタメンバを登録する
+/*!
+  直前に登録した範囲と連続していれば1つの範囲にまとめるので，連続する
+  メンバを順に登録すれば1回の読み書きで済む．
+*/
+void
+Object::Desc::add(const Guts& g)
 {
-    u_int       i = 0;
-    while (_p[i] != 0)
-	++i;
-    return i;
+    if (!_guts.empty() && _guts.back().off + _guts.back().len == g.off)
+	_guts.back().len += g.len;
+    else
+	_guts.push_back(g);
 }
 
-bool
-Object::Desc::setMbrp()
+//! メンバの配置を要約した値を返す
+/*!
+  クラスID，ポインタメンバのword index，要素数を伴う配列およびbyte列と
+  して扱うメンバの範囲から求めたFNV-1a hash値であり，0にはならない．
+  PersistentHeap が記録されたオブジェクトの配置と現在のクラス定義を照合
+  するのに用いる．
+*/
+u_long
+Object::Desc::fingerprint() const
 {
-    if (!_init)		// Not initialized yet?
+    u_long	h = 14695981039346656037ul;
+    const auto	mix = [&h](u_long x){h = (h ^ x) * 1099511628211ul;};
+    mix(_id);
+    for (const u_int* s = slot(); *s != 0; ++s)
+	mix(*s);
+    for (size_t i = 0; i < _arr.size(); ++i)
     {
-	Desc*	base = (_map->find(_bid) == _map->end() ? 0 : (*_map)[_bid]);
-
-	if (base != 0 && base->setMbrp() == true)
-	{
-	    Mbrp* q = new Mbrp[base->nMbrp() + nMbrp() + 1];
-	    int i = 0;
-	    while ((q[i] = base->_p[i]) != 0)
-		++i;
-	    for (int j = 0; (q[i] = _p[j]) != 0; ++j)
-		++i;
-	    delete [] _p;
-	    _p = q;
-
-	    _init = true;
-	}
+	mix(_arr[i].cnt);
+	mix(_arr[i].slot);
+	mix(_arr[i].trailing);
+    }
+    for (size_t i = 0; i < _guts.size(); ++i)
+    {
+	mix(_guts[i].off);
+	mix(_guts[i].len);
     }
+    return (h != 0 ? h : 1);
+}
 
-    return _init;
+//! ポインタメンバのword indexからbitmapを求める
+/*!
+  GC，保存および複製は，メンバへのポインタの代わりにword index(オブジェ
+  クト先頭からのpointer単位のoffset)を用いてメンバを辿る．vtableへの
+  ポインタが先頭にあるので，index 0がメンバを指すことはなく，配列の終端
+  を表すのに用いる．
+*/
+void
+Object::Desc::bitmap()
+{
+    _bm	  = 0;
+    _wide = false;
+    for (const u_int* s = &_slot[0]; *s != 0; ++s)
+	if (*s < 8*sizeof(_bm))
+	    _bm |= (u_long(1) << *s);
+	else
+	    _wide = true;
 }
- 
+
 }
@@ -0,0 +1,266 @@
+/*
+ *  $Id$
+ */
+#include "Object++_.h"
+#include <climits>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <execinfo.h>
+
+namespace TU
+{
+/************************************************************************
+*  static functions							*
+************************************************************************/
+//! 平均intervalの指数分布に従う次の抽出までのbyte数を返す
+/*!
+  抽出間隔を乱数で揺らすことにより，一定の大きさの確保が周期的に繰り返
+  される場合にも偏りなく抽出される．
+*/
+static long
+nextCountdown(size_t interval)
+{
+    static std::minstd_rand	rng;
+    std::exponential_distribution<double>	exp(1.0 / interval);
+    const double	n = exp(rng);
+    return (n < double(LONG_MAX) ? long(n) : LONG_MAX);
+}
+
+/************************************************************************
+*  class HeapProfiler:	sampling profiler of object allocations		*
+************************************************************************/
+//! 抽出を開始する
+/*!
+  それまでに記録された抽出結果は破棄される．
+  \param interval	抽出間隔の平均(byte数)．
+*/
+void
+HeapProfiler::start(size_t interval)
+{
+    reset();
+    _interval  = (interval != 0 ? interval : 1);
+    _countdown = nextCountdown(_interval);
+}
+
+//! 抽出を停止する
+/*!
+  記録された抽出結果は dump() 等で出力できるよう保持される．
+*/
+void
+HeapProfiler::stop()
+{
+    _countdown = LONG_MAX;
+}
+
+//! 抽出結果をgperftoolsのheap profile形式で出力する
+/*!
+  同一のスタックトレースを持つ抽出結果がまとめられ，現在も生存している
+  もの(inuse)と全て(alloc)のオブジェクト数とbyte数が出力される．pprof
+  は抽出間隔をもとに実際の値を推定する．
+  \param out	出力ストリーム．
+*/
+void
+HeapProfiler::dump(std::ostream& out)
+{
+    struct Count
+    {
+	u_long	inuse, inuseBytes, alloc, allocBytes;
+    };
+    typedef std::map<std::vector<void*>, Count>	Map;
+
+    const auto	add = [](Count& c, u_long n, u_long bytes, bool live)
+		      {
+			  if (live)
+			  {
+			      c.inuse	   += n;
+			      c.inuseBytes += bytes;
+			  }
+			  c.alloc      += n;
+			  c.allocBytes += bytes;
+		      };
+    Map		stats;
+    Count	total = {0, 0, 0, 0};
+    for (size_t i = 0; i < _samples.size(); ++i)
+    {
+	const Sample&	s = _samples[i];
+	add(stats[std::vector<void*>(s.pc, s.pc + s.depth)], 1, s.size, true);
+	add(total, 1, s.size, true);
+    }
+    for (StackStats::const_iterator i = _byStack.begin();
+	 i != _byStack.end(); ++i)
+    {
+	add(stats[i->first], i->second.alloc, i->second.allocBytes, false);
+	add(total, i->second.alloc, i->second.allocBytes, false);
+    }
+
+    out << "heap profile: " << total.inuse << ": " << total.inuseBytes
+	<< " [" << total.alloc << ": " << total.allocBytes
+	<< "] @ heap_v2/" << _interval << std::endl;
+    for (Map::const_iterator i = stats.begin(); i != stats.end(); ++i)
+    {
+	const Count&	c = i->second;
+	out << c.inuse << ": " << c.inuseBytes
+	    << " [" << c.alloc << ": " << c.allocBytes << "] @";
+	for (size_t d = 0; d < i->first.size(); ++d)
+	    out << ' ' << i->first[d];
+	out << std::endl;
+    }
+
+  // Append the memory map for symbolization.
+    out << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream	maps("/proc/self/maps");
+    out << maps.rdbuf();
+}
+
+//! 抽出結果をクラス毎に集計して出力する
+/*!
+  各行はクラスID，抽出されたオブジェクト数とbyte数，そのうち生存して
+  いるものの数とbyte数，および抽出されたオブジェクトが生き延びたGCの
+  平均回数である．クラスIDが0のものは，構築が始まる前に解放された
+  ものである．
+  \param out	出力ストリーム．
+*/
+void
+HeapProfiler::dumpByClass(std::ostream& out)
+{
+    struct Count
+    {
+	u_long	alloc, allocBytes, inuse, inuseBytes, ngc;
+    };
+    typedef std::map<u_short, Count>	Map;
+
+    Map	stats;
+    for (ClassStats::const_iterator i = _byClass.begin();
+	 i != _byClass.end(); ++i)
+    {
+	Count&	c = stats[i->first];
+	c.alloc      += i->second.alloc;
+	c.allocBytes += i->second.allocBytes;
+	c.ngc	     += i->second.ngc;
+    }
+    for (size_t i = 0; i < _samples.size(); ++i)
+    {
+	Sample&	s = _samples[i];
+	Count&	c = stats[classID(s)];
+	++c.alloc;
+	c.allocBytes += s.size;
+	++c.inuse;
+	c.inuseBytes += s.size;
+	c.ngc	     += s.ngc;
+    }
+
+    out << "# class\talloc\tbytes\tinuse\tbytes\tGCs survived (sampled every "
+	<< _interval << " bytes)" << std::endl;
+    for (Map::const_iterator i = stats.begin(); i != stats.end(); ++i)
+    {
+	const Count&	c = i->second;
+	out << i->first << '\t' << c.alloc << '\t' << c.allocBytes << '\t'
+	    << c.inuse << '\t' << c.inuseBytes << '\t'
+	    << double(c.ngc) / c.alloc << std::endl;
+    }
+}
+
+//! 確保されたばかりのメモリを抽出してスタックトレースを記録する
+/*!
+  オブジェクトはまだ構築されていないので，クラスIDはそれが死んだ時点，
+  または出力の時点で求める．
+  \param p	確保されたメモリ．
+  \param size	要求されたbyte数．
+*/
+void
+HeapProfiler::sample(const void* p, size_t size)
+{
+    _countdown = nextCountdown(_interval);
+
+    _samples.push_back(Sample());
+    Sample&	s = _samples.back();
+    s.obj   = (const Object*)p;
+    s.size  = size;
+    s.ngc   = 0;
+    s.depth = backtrace(s.pc, MAXDEPTH);
+}
+
+//! GCの印をもとに，抽出されたオブジェクトの生死を記録する
+/*!
+  mark の後，sweepおよびFinalizerによる延命の前に呼ばれる．死んだもの
+  は集計に畳み込んで取り除く．
+*/
+void
+HeapProfiler::scan()
+{
+    size_t	nlive = 0;
+    for (size_t i = 0; i < _samples.size(); ++i)
+    {
+	Sample&	s = _samples[i];
+	if (Page::marked(s.obj))
+	{
+	    ++s.ngc;
+	    if (nlive != i)
+		_samples[nlive] = s;
+	    ++nlive;
+	}
+	else
+	    retire(s);
+    }
+    _samples.resize(nlive);
+}
+
+//! 指定された範囲にある抽出されたオブジェクトを解放済みとする
+/*!
+  RegionScope がその領域を解放する際に呼ばれる．
+*/
+void
+HeapProfiler::release(const void* begin, const void* end)
+{
+    size_t	nlive = 0;
+    for (size_t i = 0; i < _samples.size(); ++i)
+    {
+	Sample&	s = _samples[i];
+	if (begin <= (const void*)s.obj && (const void*)s.obj < end)
+	    retire(s);
+	else
+	{
+	    if (nlive != i)
+		_samples[nlive] = s;
+	    ++nlive;
+	}
+    }
+    _samples.resize(nlive);
+}
+
+//! 抽出されたオブジェクトのクラスIDを求める
+/*!
+  オブジェクトはまだ構築途中かもしれないので，クラスIDをヘッダにキャッ
+  シュしない Object::currentDesc() で求める．
+  \return	クラスID．まだ構築が始まっていない(vtableへのポインタが
+		0である)場合は0．
+*/
+u_short
+HeapProfiler::classID(const Sample& s)
+{
+    return (*(void* const*)s.obj != 0 ? s.obj->currentDesc().id() : 0);
+}
+
+//! 死んだ抽出結果をスタックトレース毎およびクラス毎の集計に加える
+void
+HeapProfiler::retire(const Sample& s)
+{
+    for (Stat* st : {&_byStack[std::vector<void*>(s.pc, s.pc + s.depth)],
+		     &_byClass[classID(s)]})
+    {
+	++st->alloc;
+	st->allocBytes += s.size;
+	st->ngc	       += s.ngc;
+    }
+}
+
+void
+HeapProfiler::reset()
+{
+    _samples.clear();
+    _byStack.clear();
+    _byClass.clear();
+}
+
+}
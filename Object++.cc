@@ -2,12 +2,52 @@
  *  $Id$
  */
 #include "TU/Object++.h"
+#include <iterator>
 
 namespace TU
 {
 /************************************************************************
 *  class Cons:	cons cell						*
 ************************************************************************/
+//! 連続したn個のcellからなる新たなリストを生成する
+/*!
+  全てのcellのためのメモリを Object::allocate() によってまとめて確保し，
+  アドレスの昇順に連結する．
+  \param n	cellの数．
+  \param tail	最後のcellのcdr．
+  \return	生成されたリスト．各cellのcarは0である．
+*/
+template <class T> Ptr<Cons<T> >
+Cons<T>::alloc(u_int n, Cons* tail)
+{
+    const size_t	stride = cellsize(sizeof(Cons));
+    Ptr<Cons>		head = tail;
+    while (n > 0)
+    {
+	u_int	k = n;
+	char*	p = (char*)allocate(sizeof(Cons), k);	// may cause GC
+	for (u_int i = k; i-- > 0; )
+	    head = new(p + i*stride) Cons(0, head);
+	n -= k;
+    }
+    return head;
+}
+
+//! 指定された範囲の要素をcarとするリストを生成する
+/*!
+  \param first	範囲の先頭を指す前進反復子．
+  \param last	範囲の末尾の次を指す前進反復子．
+  \return	生成されたリスト．
+*/
+template <class T> template <class ITER> Ptr<Cons<T> >
+Cons<T>::fromRange(ITER first, ITER last)
+{
+    Ptr<Cons>	head = alloc(std::distance(first, last), 0);
+    for (Cons* cns = head; first != last; ++first, cns = cns->_cd)
+	cns->_ca = *first;
+    return head;
+}
+
 template <class T> const Cons<T>*
 Cons<T>::nthcdr(int n) const
 {
@@ -56,19 +96,30 @@ Cons<T>::length() const
 template <class T> Ptr<Cons<T> >
 Cons<T>::reverse() const
 {
-    Ptr<Cons>	rev;
+    Ptr<Cons>	cells = alloc(length(), 0);
+    Cons	*dst = cells, *rev = 0;
     for (const Cons* cns = this; cns->consp(); cns = cns->cdr())
-	rev = rev->cons(cns->car());
+    {
+	Cons* const	nxt = dst->_cd;
+	dst->_ca = cns->car();		// Fill the cells in order and
+	dst->_cd = rev;			// relink them in reverse at once.
+	rev = dst;
+	dst = nxt;
+    }
     return rev;
 }
 
 template <class T> Ptr<Cons<T> >
 Cons<T>::append(Cons* cns) const
 {
-    if (!consp())
-	return cns;
-    else
-	return cdr()->append(cns)->cons(car());
+    Ptr<Cons>	head = alloc(length(), cns);
+    Cons*	dst  = head;
+    for (const Cons* src = this; src->consp(); src = src->cdr())
+    {
+	dst->_ca = src->car();
+	dst	 = dst->_cd;
+    }
+    return head;
 }
 
 template <class T> const Cons<T>*
@@ -92,11 +143,19 @@ Cons<T>::member(const T* item)
 template <class T> Ptr<Cons<T> >
 Cons<T>::remove(const T* item) const
 {
-    Ptr<Cons>	rmv;
+    u_int	n = 0;
+    for (const Cons* cns = this; cns->consp(); cns = cns->cdr())
+	if (cns->car() != item)
+	    ++n;
+    Ptr<Cons>	rmv = alloc(n, 0);
+    Cons*	dst = rmv;
     for (const Cons* cns = this; cns->consp(); cns = cns->cdr())
 	if (cns->car() != item)
-	    rmv = rmv->cons(cns->car());
-    return rmv->nreverse();
+	{
+	    dst->_ca = cns->car();
+	    dst	     = dst->_cd;
+	}
+    return rmv;
 }
 
 template <class T> Ptr<Cons<T> >
@@ -139,5 +198,376 @@ Cons<T>::detach(const T* item)
 	    prev = cns;
     return head;
 }
+
+//! 自身をcdrとし，指定されたcarを持つ共有されたconsセルを返す
+/*!
+  同じcarとcdrを持つconsセルが既にあればそれを返す(hash-consing)．
+  共有されるので，返されたセルに rplaca() や rplacd() を適用してはなら
+  ない．共有されたセルのみからなるリストは，ポインタの比較によって
+  構造の同一性を判定できる．
+*/
+template <class T> Ptr<Cons<T> >
+Cons<T>::hcons(T* ca)
+{
+    struct Hash
+    {
+	size_t	operator ()(const std::pair<const T*, const Cons*>& key) const
+		{
+		    return std::hash<const void*>()(key.first)
+			 ^ (std::hash<const void*>()(key.second) << 1);
+		}
+    };
+    static InternTable<std::pair<const T*, const Cons*>, Cons, Hash>	table;
+
+    Cons*	cd = this;
+    return table.intern(std::make_pair(ca, cd),
+			[ca, cd](){return new Cons(ca, cd);});
+}
+
+/************************************************************************
+*  class CdrList:	CDR-coded list storing runs of cars contiguously	*
+************************************************************************/
+template <class T> typename CdrList<T>::Cursor
+CdrList<T>::Cursor::cdr() const
+{
+    if (_run == 0)
+	return Cursor(0, 0, _cns->cdr());
+    else if (_i + 1 < _run->_n)
+	return Cursor(_run, _i + 1);
+    else if (_run->_nx != 0)
+	return Cursor(_run->_nx);
+    else
+	return Cursor(0, 0, _run->_cd);
+}
+
+template <class T> typename CdrList<T>::Cursor&
+CdrList<T>::Cursor::rplaca(T* ca)
+{
+    if (_run == 0)
+	_cns->rplaca(ca);
+    else
+	_run->_ca[_i] = ca;
+    return *this;
+}
+
+//! この位置の後に続くリストを置き換える
+/*!
+  run の途中であれば，この位置でrunを打ち切り，残りのリストとして通常の
+  consセルからなる cd を続ける．
+*/
+template <class T> typename CdrList<T>::Cursor&
+CdrList<T>::Cursor::rplacd(Cons<T>* cd)
+{
+    if (_run == 0)
+	_cns->rplacd(cd);
+    else
+    {
+	for (u_int i = _i + 1; i < _run->_n; ++i)
+	    _run->_ca[i] = 0;		// Release cars no longer in the list.
+	_run->_n  = _i + 1;
+	_run->_nx = 0;
+	_run->_cd = cd;
+    }
+    return *this;
+}
+
+//! リストの要素をrunに詰め直した新たなリストを返す
+/*!
+  listが空であっても，carを持たないrunが1つだけの空のリストが返される．
+*/
+template <class T> Ptr<CdrList<T> >
+CdrList<T>::pack(const Cons<T>* list)
+{
+    Ptr<CdrList>	head = new CdrList;
+    CdrList*		run  = head;	// reachable from head
+    for (; list->consp(); list = list->cdr())
+    {
+	if (run->_n == NCARS)
+	{
+	    run->_nx = new CdrList;
+	    run = run->_nx;
+	}
+	run->_ca[run->_n++] = list->car();
+    }
+    run->_cd = const_cast<Cons<T>*>(list);
+    return head;
+}
+
+template <class T> Ptr<Cons<T> >
+CdrList<T>::unpack() const
+{
+    Ptr<Cons<T> >	rev;
+    const CdrList*	run = this;
+    for (; run->_nx != 0; run = run->_nx)
+	for (u_int i = 0; i < run->_n; ++i)
+	    rev = rev->cons(run->_ca[i]);
+    for (u_int i = 0; i < run->_n; ++i)
+	rev = rev->cons(run->_ca[i]);
+    return rev->nreverse()->nconc(run->_cd);
+}
+
+template <class T> typename CdrList<T>::Cursor
+CdrList<T>::nthcdr(int n)
+{
+    CdrList*	run = this;
+    for (; n >= int(run->_n); run = run->_nx)
+    {
+	n -= run->_n;
+	if (run->_nx == 0)
+	    return Cursor(0, 0, run->_cd->nthcdr(n));
+    }
+    return Cursor(run, n);
+}
+
+template <class T> int
+CdrList<T>::length() const
+{
+    int			n = 0;
+    const CdrList*	run = this;
+    for (; run->_nx != 0; run = run->_nx)
+	n += run->_n;
+    return n + run->_n + run->_cd->length();
+}
+
+template <class T> typename CdrList<T>::Cursor
+CdrList<T>::member(const T* item)
+{
+    CdrList*	run = this;
+    for (; run != 0; run = run->_nx)
+    {
+	for (u_int i = 0; i < run->_n; ++i)
+	    if (run->_ca[i] == item)
+		return Cursor(run, i);
+	if (run->_nx == 0)
+	    return Cursor(0, 0, run->_cd->member(item));
+    }
+    return Cursor();
+}
+
+/************************************************************************
+*  class Vector:	growable array of pointers to objects		*
+************************************************************************/
+template <class T> Ptr<Vector<T> >
+Vector<T>::create(u_int n)
+{
+    Ptr<Vector>	v = new Vector;
+    v->resize(n);
+    return v;
+}
+
+//! 少なくとも指定された数の要素を格納できる領域を確保する
+template <class T> void
+Vector<T>::reserve(u_int n)
+{
+    if (n > capacity())
+	_a = Array::createSpine(n, _a);	// may cause GC
+}
+
+template <class T> void
+Vector<T>::resize(u_int n)
+{
+    reserve(n);
+    for (u_int i = n; i < _n; ++i)
+	(*this)[i] = 0;			// Release the removed elements.
+    _n = n;
+}
+
+//! 末尾に要素を加える
+/*!
+  格納領域を拡張する際にGCが生じ得るので，このVectorとxは呼び出し側で
+  Ptr 等によって保護しておくこと．
+*/
+template <class T> void
+Vector<T>::push_back(T* x)
+{
+    if (_n == capacity())
+	reserve(_n < 4 ? 8 : 2*_n);
+    (*this)[_n++] = x;
+}
+
+//! 末尾の要素を取り除く
+/*!
+  取り除いた要素への参照は消されるので，それを使い続けるならば呼び出し
+  側で保護しておくこと．
+*/
+template <class T> void
+Vector<T>::pop_back()
+{
+    if (_n == 0)
+	throw std::domain_error("TU::Vector<T>::pop_back\tEmpty vector!!");
+    (*this)[--_n] = 0;
+}
+
+/************************************************************************
+*  class HashMap:	hash table mapping objects to objects		*
+************************************************************************/
+//! キーが格納されている位置，または格納されるべき空き位置を返す
+template <class K, class V> u_int
+HashMap<K, V>::lookup(const K* key) const
+{
+    const u_int	mask = capacity() - 1;
+    u_int	i = hash(key);
+    for (Object* k; (k = slot(2*i)) != 0 && k != key; )
+	i = (i + 1) & mask;
+    return i;
+}
+
+//! 指定された大きさの新しい表に全エントリを格納し直す
+template <class K, class V> void
+HashMap<K, V>::rehash(u_int cap)
+{
+    Array*	old = _a;
+    _a = Array::createSpine(2*cap);	// old is reachable via _a meanwhile.
+    _dirty = false;
+    for (u_int j = 0; j < Array::capacity(old); j += 2)
+	if (Array::at(old, j) != 0)
+	{
+	    const u_int	i = lookup((K*)Array::at(old, j));
+	    slot(2*i)   = Array::at(old, j);
+	    slot(2*i+1) = Array::at(old, j+1);
+	}
+}
+
+template <class K, class V> V*
+HashMap<K, V>::find(const K* key) const
+{
+    if (_n == 0)
+	return 0;
+    update();
+    return (V*)slot(2*lookup(key) + 1);
+}
+
+//! エントリを登録する．キーが既にあれば値を置き換える
+/*!
+  表を拡張する際にGCが生じ得るので，keyとvalは呼び出し側で保護しておく
+  こと．
+*/
+template <class K, class V> void
+HashMap<K, V>::insert(K* key, V* val)
+{
+    update();
+    if (2*(_n + 1) > capacity())
+	rehash(capacity() < 4 ? 8 : 2*capacity());
+    const u_int	i = lookup(key);
+    if (slot(2*i) == 0)
+    {
+	slot(2*i) = key;
+	++_n;
+    }
+    slot(2*i+1) = val;
+}
+
+template <class K, class V> bool
+HashMap<K, V>::erase(const K* key)
+{
+    if (_n == 0)
+	return false;
+    update();
+    const u_int	mask = capacity() - 1;
+    u_int	i = lookup(key);
+    if (slot(2*i) == 0)
+	return false;
+
+  // Shift back the following entries to fill the hole.
+    for (u_int j = i; (j = (j + 1) & mask), slot(2*j) != 0; )
+    {
+	const u_int	h = hash((K*)slot(2*j));
+	if ((i <= j ? (h <= i || h > j) : (h <= i && h > j)))
+	{
+	    slot(2*i)   = slot(2*j);
+	    slot(2*i+1) = slot(2*j+1);
+	    i = j;
+	}
+    }
+    slot(2*i) = slot(2*i+1) = 0;
+    --_n;
+    return true;
+}
+
+template <class K, class V> template <class F> void
+HashMap<K, V>::forEach(F f) const
+{
+    if (_n == 0)
+	return;
+    update();
+    for (u_int j = 0; j < 2*capacity(); j += 2)
+	if (slot(j) != 0)
+	    f((K*)slot(j), (V*)slot(j+1));
+}
+
+/************************************************************************
+*  class WeakMap:	hash table mapping objects weakly to objects	*
+************************************************************************/
+template <class K, class V> bool
+WeakMap<K, V>::markValues()
+{
+    bool	more = false;
+    for (typename Map::const_iterator i = _map.begin(); i != _map.end(); ++i)
+	if (marked(i->first) && mark(i->second))
+	    more = true;
+    return more;
+}
+
+template <class K, class V> void
+WeakMap<K, V>::removeDead()
+{
+    for (typename Map::iterator i = _map.begin(); i != _map.end(); )
+	if (marked(i->first))
+	    ++i;
+	else
+	    i = _map.erase(i);
+}
+
+template <class K, class V> void
+WeakMap<K, V>::release(const void* begin, const void* end)
+{
+    for (typename Map::iterator i = _map.begin(); i != _map.end(); )
+	if (within(i->first, begin, end) || within(i->second, begin, end))
+	    i = _map.erase(i);
+	else
+	    ++i;
+}
+
+/************************************************************************
+*  class InternTable<KEY, T>:	weak table of unique objects		*
+************************************************************************/
+//! 指定された値を持つ唯一のオブジェクトを返す
+/*!
+  まだ登録されていなければ create() によって生成して登録する．
+  \param key	値．
+  \param create	keyの値を持つオブジェクトを生成して返す関数．
+  \return	keyの値を持つオブジェクト．
+*/
+template <class KEY, class T, class HASH> template <class F> T*
+InternTable<KEY, T, HASH>::intern(const KEY& key, F create)
+{
+    T*	obj = find(key);
+    if (obj == 0)
+    {
+	obj = create();			// may cause GC and removeDead()
+	_map[key] = obj;
+    }
+    return obj;
+}
+
+template <class KEY, class T, class HASH> void
+InternTable<KEY, T, HASH>::removeDead()
+{
+    for (typename Map::iterator i = _map.begin(); i != _map.end(); )
+	if (marked(i->second))
+	    ++i;
+	else
+	    i = _map.erase(i);
+}
+
+template <class KEY, class T, class HASH> void
+InternTable<KEY, T, HASH>::release(const void* begin, const void* end)
+{
+    for (typename Map::iterator i = _map.begin(); i != _map.end(); )
+	if (within(i->second, begin, end))
+	    i = _map.erase(i);
+	else
+	    ++i;
+}
  
 }
@@ -2,6 +2,9 @@
  *  $Id$
  */
 #include "TU/Object++.h"
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
 
 namespace TU
 {
@@ -12,7 +15,19 @@ namespace TU
   pageを表すクラス．pageとは，システムがheap領域から確保して自分の
   管理下に置き，ユーザからの要求に応じて貸し出すためのメモリ領域である．
   GCを行ってもユーザからの要求に応えられない場合は，新たなpageが確保
-  される．
+  される．pageはその大きさに整列して確保されるので，cellのアドレスから
+  それを含むpageが直ちに求まる．
+
+  PersistentHeap が開かれていれば，pageはそのファイルから切り出される．
+
+  cellの印(ObjectHeader::_gc)は，その値がpage毎の _mark に等しいときに
+  印が付いていることを表す．markingは印を付ける度にpageの生存block数
+  _live を加算するので，sweepは全て生きているpageを _mark を反転する
+  だけで，全て死んでいるpageを1つのcellに戻すだけで済ませ，残りのpage
+  のみを走査する．
+
+  各pageはユーザに貸し出したcellの先頭blockを bitmap _start に記録する．
+  これにより StackScanner はcellの内部を指すアドレスからcellを求める．
 */  
 class Page
 {
@@ -21,44 +36,71 @@ class Page
 
   /*!
     cellを表すクラス．ユーザからの1回の要求毎に1つのcellがpageから切り取られて
-    ユーザに貸し出される．
+    ユーザに貸し出される．free listは単方向で，sweepの度に作り直される．
+    オブジェクトのvtableへのポインタの位置にリンクを，ヘッダの位置に
+    ObjectHeaderを置くので，cellの最小の大きさは2 wordsである．
   */  
-    class Cell : private ObjectHeader
+    class Cell
     {
 	enum			{TBLSIZ = 16};	// TBLSIZ = 4 or 10 or 16.
 	
       public:
-	Cell(u_int nb=0) :ObjectHeader(nb), _prv(this), _nxt(this)	{}
+	Cell(u_int nb=0) :_nxt(0), _h(nb)	{unmark();}
 
-	static Cell*		find(u_int nblocks, bool addition=false);
+	static Cell*		take(u_int nblocks)	;
+	static void		clear()			;
+	static void		splice(Cell* const head[])	;
+	u_int			nblocks()	const	{return _h._nb;}
+	bool			marked() const
+				{
+				    return _h._gc == page(this)->_mark;
+				}
+	void			unmark()	{_h._gc = !page(this)->_mark;}
 	Cell*			forward() const
 				{
-				    return (Cell*)((Block*)this + _nb);
+				    return (Cell*)((Block*)this + _h._nb);
 				}
-	u_int			add();
-	Cell*			detach();
+	u_int			add()			{return add(_head);}
+	u_int			add(Cell* head[])	;
 	Cell*			split(u_int nblocks);
 	Cell*			merge()
 				{
-				    _nb += forward()->_nb; 
+				    _h._nb += forward()->_h._nb; 
 				    return this;
 				}
 	void*			clean();
 	
       private:
-	static Cell		_head[TBLSIZ];	// doubly-linked list heads.
+	static u_int		index(u_int nblocks)
+				{ // Find i s.t. 2^i <= nblocks-1 < 2^(i+1).
+				    u_int	i = 0;
+				    for (u_int n = nblocks - 1; n >>= 1; )
+					++i;
+				    return i;
+				}
+	
+	static Cell*		_head[TBLSIZ];	// singly-linked list heads.
 
-	Cell*			_prv;		// doubly-linked to other node.
-	Cell*			_nxt;		// ibid.
+	Cell*			_nxt;		// in place of vptr of object
+	ObjectHeader		_h;		// same as header of object
 
-	friend class		Page;		// allow access to header
+	friend class		Page;		// allow access to TBLSIZ
+	friend class		PersistentHeap;	// allow access to _h
     };
 
     class Root
     {
       public:
 	Root()	:_p(0)				{}
-	~Root()					{while (_p != 0) delete _p;}
+	~Root()
+	{
+	    while (_p != 0)
+	    {
+		Page*	page = _p;
+		_p = page->_nxt;
+		delete page;
+	    }
+	}
 	
       			operator Page*() const 	{return _p;}
       	Root&		operator = (Page* page)	{_p = page; return *this;}
@@ -70,11 +112,15 @@ class Page
     
   private:
     enum		{NBLOCKS = (1 << Cell::TBLSIZ)};
+    enum		{PAGES_PER_THREAD = 4};	// min. # of pages per sweeper
     
   public:
     Page()						;
-    ~Page()						{_root = _root->_nxt;}
+    static void*	operator new(size_t size)	;
+    static void*	operator new(size_t, void* p)	{return p;}
+    static void		operator delete(void* p)	;
     static u_int	sweep()				;
+    static u_int	maxblocks()			{return NBLOCKS;}
     static u_int	nbytes2nblocks(size_t nbytes)
 			{ // must have enough size for a Cell.
 			    size_t	nb = (nbytes > sizeof(Cell) ?
@@ -82,13 +128,58 @@ class Page
 			    u_int nblocks = (nb-1) / sizeof(Block) + 1;
 			    return (nblocks <= NBLOCKS ? nblocks : 0);
 			}
-
+    static Page*	page(const void* p)
+			{
+			    return (Page*)(uintptr_t(p) &
+					   ~uintptr_t(sizeof(Block)*NBLOCKS - 1));
+			}
+    static bool		marked(const void* p)
+			{
+			    return ((const Cell*)p)->marked();
+			}
+    static void		mark(const void* p)
+			{
+			    Cell* const	cell = (Cell*)p;
+			    Page* const	pg   = page(cell);
+			    cell->_h._gc = pg->_mark;
+			    pg->_live += cell->_h._nb;
+			}
+    static Page*	region()			;
+    static void		release(Page* page)		;
+    Cell*		find(const void* p)	const	;
+    
   private:
+    enum		{NWORDS = NBLOCKS / (8*sizeof(u_long))};
+
+    explicit Page(bool shared)				;
+
+    void		setStart(const Cell* cell)
+			{
+			    const u_int	b = (const Block*)cell - _block;
+			    _start[b / (8*sizeof(u_long))]
+				|= u_long(1) << (b % (8*sizeof(u_long)));
+			}
+    void		clearStart(const Cell* cell)
+			{
+			    const u_int	b = (const Block*)cell - _block;
+			    _start[b / (8*sizeof(u_long))]
+				&= ~(u_long(1) << (b % (8*sizeof(u_long))));
+			}
+
+    u_int		sweep(Cell* head[])		;
+    
     static Root		_root;			// root of memory page list.
+    static Root		_spare;			// unused pages for regions.
 
     Block		_block[NBLOCKS];	// used as cells.
-    Page* const		_nxt;
+    Page*		_nxt;
+    u_int		_live;			// # of blocks marked.
+    bool		_mark;			// value of marked _gc.
+    u_long		_start[NWORDS];		// first blocks of lent cells.
 
+    friend class	RegionScope;		// allow access to _block
+    friend class	PersistentHeap;		// allow access to _root etc.
+    friend class	StackScanner;		// allow access to _root
 };
 
 /************************************************************************
@@ -189,5 +280,160 @@ class CopyMap
   private:
     static Map		_map;
 };
+
+/************************************************************************
+*  class ParallelCopyMap:	a map for registering objects copied by	*
+*				multiple threads			*
+************************************************************************/
+class ParallelCopyMap
+{
+  private:
+    typedef std::unordered_map<const Object*, Object*>	Map;
+
+    struct Shard
+    {
+	std::mutex	mtx;
+	Map		map;
+    };
+    
+  public:
+    ParallelCopyMap(u_int nshards)
+	:_nshards(nshards), _shards(new Shard[nshards])		{}
+
+  //! 未登録のオブジェクトならば登録してtrueを返す(複数スレッドから可)
+    bool		insert(const Object* obj)
+			{
+			    Shard&	shard = _shards[index(obj)];
+			    std::lock_guard<std::mutex>	lock(shard.mtx);
+			    return shard.map.insert(
+					std::make_pair(obj, (Object*)0)).second;
+			}
+  //! 登録済みのオブジェクトの複製を返す(insert()と並行して呼んではならない)
+    Object*&		operator [](const Object* obj)
+			{
+			    return _shards[index(obj)].map.find(obj)->second;
+			}
+    
+  private:
+    u_int		index(const Object* obj) const
+			{
+			    return (u_long(obj) / sizeof(Page::Block))
+				 % _nshards;
+			}
+
+    const u_int			_nshards;
+    std::unique_ptr<Shard[]>	_shards;
+};
+
+/************************************************************************
+*  class GCInhibitor:	suppress garbage collection while alive		*
+************************************************************************/
+class GCInhibitor
+{
+  public:
+    GCInhibitor()				{++_n;}
+    ~GCInhibitor()				{--_n;}
+
+    static bool		inhibited()		{return _n != 0;}
+
+  private:
+    static u_int	_n;
+};
+
+/************************************************************************
+*  class CellBatch:	cells allocated in bulk for a worker thread	*
+************************************************************************/
+/*!
+  Object::parallelCopyObject() の作業スレッドの中で生存している間は，
+  そのスレッドでの Object::operator new および Object::newFinalizable
+  がこれからメモリを得る．同じ大きさのcellを Object::allocate() によって
+  排他的にまとめて切り出しておき，以後はロックせずに1つずつ貸し出す．
+  使い残したcellはどこからも参照されないので次のGCで回収される．
+  RegionScope の中では用いてはならない．
+*/
+class CellBatch
+{
+  private:
+    enum		{NCELLS = 64};		// # of cells per refill
+
+    struct Run
+    {
+	Run()	:p(0), n(0)			{}
+
+	char*	p;				// next cell to lend
+	u_int	n;				// # of cells left
+    };
+
+  public:
+  //! 作業スレッドによる共有heapからの切り出しを排他する
+    class Lock : public std::lock_guard<std::mutex>
+    {
+      public:
+	Lock()	:std::lock_guard<std::mutex>(_mtx)	{}
+    };
+    
+    CellBatch()					{_cur = this;}
+    ~CellBatch()				{_cur = 0;}
+
+    static CellBatch*	current()		{return _cur;}
+    void*		allocate(size_t size, bool finalizable)	;
+
+  private:
+    std::unordered_map<size_t, Run>	_runs;	// keyed by cell size
+    static std::mutex			_mtx;	// guards the shared heap
+    static thread_local CellBatch*	_cur;
+};
+
+/************************************************************************
+*  class Finalizer:	destructs dead objects of finalizable classes	*
+************************************************************************/
+/*!
+  DECLARE_FINALIZABLE を宣言したクラスのオブジェクトは生成時に登録される．
+  GCで印の付かなかった登録オブジェクトは待ち行列に移され，デストラクタ
+  が実行されるまで再び印を付けられて回収を免れる．デストラクタは
+  Object::finalize() を呼んだ時点，または専用のスレッドで実行される．
+
+  Object::collect() は Lock を保持するので，専用スレッドのデストラクタ
+  はGCと並行しては走らない．ただし，mutatorとは並行して走るので，
+  デストラクタはオブジェクトを確保したり Ptr を生成したりしてはならない．
+  待ち行列に移す際にクラスIDをヘッダにキャッシュしておくので，
+  HeapProfiler はデストラクタが書き換えるvtableへのポインタを辿らない．
+*/
+class Finalizer
+{
+  public:
+  //! GCと専用スレッドによるデストラクタの実行とを排他する
+    class Lock : public std::lock_guard<std::mutex>
+    {
+      public:
+	Lock()	:std::lock_guard<std::mutex>(_mtx)	{}
+    };
+    
+    static void*	enroll(void* p)
+			{
+			    _objs.push_back((Object*)p);
+			    return p;
+			}
+    static void		scan()			;
+    static u_int	run(u_int max)		;
+    static void		start()			;
+    static void		stop()			;
+
+  private:
+    struct Guard
+    {
+	~Guard()				{stop();}
+    };
+    
+    static void		loop()			;
+    
+    static std::vector<Object*>	_objs;		// live finalizable objects
+    static std::vector<Object*>	_queue;		// dead objects to finalize
+    static std::mutex		_mtx;		// protect _queue and GC
+    static std::condition_variable	_cond;
+    static std::thread		_thread;	// optional finalizer thread
+    static bool			_quit;
+    static Guard		_guard;		// join _thread at exit
+};
  
 }
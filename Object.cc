@@ -3,72 +3,627 @@
  */
 #include "Object++_.h"
 #include <stdexcept>
+#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
 
 namespace TU
 {
 /*
- *  PtrBase::mark()
+ *  PtrBase::grow(), mark()
  */
+//! 根のスタックを拡張する
+void
+PtrBase::grow()
+{
+    const u_int	size  = (_size == 0 ? 256 : 2*_size);
+    Root*	stack = new Root[size];
+    for (u_int i = 0; i < _top; ++i)
+	stack[i] = _stack[i];
+    delete [] _stack;
+    _stack = stack;
+    _size  = size;
+}
+
+//! 根のスタックに登録された全てのポインタが指すオブジェクトに印を付ける
+/*!
+  解除済みの要素(穴)は n == 0 なので読み飛ばされる．
+*/
 void
 PtrBase::mark()
 {
 #ifdef TUObjectPP_DEBUG
-    std::cerr << "\tPtrBase::mark\tmarking....\n";
+    std::cerr << "\tPtrBase::mark\tmarking " << _top << " roots....\n";
 #endif
-    for (PtrBase* objp = _root; objp; objp = objp->_nxt)
-	objp->_p->mark();
+    for (const Root* root = _stack, *end = _stack + _top; root != end; ++root)
+	for (u_int i = 0; i < root->n; ++i)
+	    if (root->p[i] != 0)
+		root->p[i]->mark();
 }
 
 /*
- *  Object::mark(), new(), save(), eoc(), restore(), copy(), cpy()
+ *  WeakBase::clear(), release(), WeakTable::marked(), mark(), markAll(),
+ *  clearAll(), releaseAll()
  */
+//! 印の付いていないオブジェクトを指す全ての弱いポインタを0にする
 void
-Object::mark() const
+WeakBase::clear()
+{
+    for (WeakBase* wp = _root; wp != 0; wp = wp->_nxt)
+	if (wp->_p != 0 && !Page::marked(wp->_p))
+	    wp->_p = 0;
+}
+
+//! 指定された範囲のオブジェクトを指す全ての弱いポインタを0にする
+/*!
+  RegionScope がその領域を解放する際に呼ばれる．
+*/
+void
+WeakBase::release(const void* begin, const void* end)
 {
-    if (null() || _gc)
+    for (WeakBase* wp = _root; wp != 0; wp = wp->_nxt)
+	if (begin <= (const void*)wp->_p && (const void*)wp->_p < end)
+	    wp->_p = 0;
+}
+
+bool
+WeakTable::marked(const Object* obj)
+{
+    return obj == 0 || Page::marked(obj);
+}
+
+//! オブジェクトとそこから到達可能なオブジェクトに印を付ける
+/*!
+  \return	新たに印を付けたらtrueを返す．
+*/
+bool
+WeakTable::mark(const Object* obj)
+{
+    if (marked(obj))
+	return false;
+    obj->mark();
+    return true;
+}
+
+//! 生きているキーに対応する値に，新たに印が付かなくなるまで印を付ける
+/*!
+  ある表の値から別の表(または同じ表)のキーが到達可能になり得るので，
+  全ての表について変化がなくなるまで繰り返す．
+*/
+void
+WeakTable::markAll()
+{
+    for (bool more = true; more; )
+    {
+	more = false;
+	for (WeakTable* tbl = _root; tbl != 0; tbl = tbl->_nxt)
+	    if (tbl->markValues())
+		more = true;
+    }
+}
+
+void
+WeakTable::clearAll()
+{
+    for (WeakTable* tbl = _root; tbl != 0; tbl = tbl->_nxt)
+	tbl->removeDead();
+}
+
+//! 全ての表から指定された範囲のオブジェクトを含むエントリを削除する
+/*!
+  RegionScope がその領域を解放する際に呼ばれる．
+*/
+void
+WeakTable::releaseAll(const void* begin, const void* end)
+{
+    for (WeakTable* tbl = _root; tbl != 0; tbl = tbl->_nxt)
+	tbl->release(begin, end);
+}
+
+/*
+ *  Finalizer::scan(), run(), start(), stop(), loop()
+ */
+//! 印の付かなかった登録オブジェクトを待ち行列に移し，回収を延期する
+/*!
+  markおよび弱参照の消去の後，sweepの前に Lock を保持した
+  Object::collect() から呼ばれる．待ち行列中のオブジェクトはデストラ
+  クタが実行されるまで毎回印を付けられる．
+*/
+void
+Finalizer::scan()
+{
+    size_t	nlive = 0;
+    for (size_t i = 0; i < _objs.size(); ++i)
+	if (Page::marked(_objs[i]))
+	    _objs[nlive++] = _objs[i];
+	else
+	{
+	    _objs[i]->classDesc();	// Cache the class ID in the header.
+	    _queue.push_back(_objs[i]);
+	}
+    _objs.resize(nlive);
+    
+    for (size_t i = 0; i < _queue.size(); ++i)
+	_queue[i]->mark();
+    if (!_queue.empty())
+	_cond.notify_one();
+}
+
+//! 待ち行列中の最大max個のオブジェクトのデストラクタを実行する
+u_int
+Finalizer::run(u_int max)
+{
+    Lock	lock;				// exclude GC
+
+    u_int	n = 0;
+    for (; n < max && !_queue.empty(); ++n)
+    {
+	Object* const	obj = _queue.back();
+	obj->~Object();
+	*(void**)obj = 0;		// No longer an object.
+	_queue.pop_back();
+    }
+    return n;
+}
+
+void
+Finalizer::start()
+{
+    if (_thread.joinable())
+	return;
+    _quit   = false;
+    _thread = std::thread(&Finalizer::loop);
+}
+
+void
+Finalizer::stop()
+{
+    if (!_thread.joinable())
 	return;
-    const_cast<Object*>(this)->_gc = 1;
-    for (const Mbrp* p = desc().mbrp(); *p != 0; )
-	(this->*(*p++))->mark();
+    {
+	std::lock_guard<std::mutex>	lock(_mtx);
+	_quit = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+//! 専用スレッドの本体
+void
+Finalizer::loop()
+{
+    std::unique_lock<std::mutex>	lock(_mtx);
+    for (;;)
+    {
+	while (_queue.empty() && !_quit)
+	    _cond.wait(lock);
+	if (_quit)
+	    return;
+	while (!_queue.empty())
+	{
+	    Object* const	obj = _queue.back();
+	    obj->~Object();
+	    *(void**)obj = 0;		// No longer an object.
+	    _queue.pop_back();
+	}
+    }
+}
+
+/*
+ *  RegionScope
+ */
+//! 以後確保されるオブジェクトのための領域を開く
+/*!
+  領域はGCの管理しない専用のページ単位で拡張される．
+*/
+RegionScope::RegionScope()
+    :_prv(_cur)
+{
+    _cur = this;
 }
 
+//! 領域を閉じ，その中に確保された全てのオブジェクトを一度に解放する
+/*!
+  TUObjectPP_DEBUG が定義されていれば，解放に先立ってGCを行い，領域内の
+  オブジェクトが根または領域外のオブジェクトから到達可能であれば(脱出)
+  異常終了する．
+*/
+RegionScope::~RegionScope()
+{
+    _cur = _prv;
+#ifdef TUObjectPP_DEBUG
+    Object::collect();			// This region is not unmarked.
+    if (u_int n = unmark(_chunks))
+    {
+	std::cerr << "TU::RegionScope::~RegionScope\t" << n
+		  << " object(s) escaped from the region!!" << std::endl;
+	std::abort();
+    }
+#endif
+    for (size_t i = 0; i < _chunks.size(); ++i)
+    {
+	WeakBase::release(_chunks[i].begin, _chunks[i].top);
+	WeakTable::releaseAll(_chunks[i].begin, _chunks[i].top);
+	HeapProfiler::release(_chunks[i].begin, _chunks[i].top);
+	Page::release(Page::page(_chunks[i].begin));
+    }
+}
+
+//! 領域内の現在の位置から指定されたblock数のcellを切り出す
 void*
-Object::operator new(size_t size)
+RegionScope::allocate(u_int nblocks)
 {
-    using namespace	std;
-  /* 要求サイズをbyte単位からblock単位に変更する．nblocks * sizeof(Block)
-     は size 以上であることはもちろん，メモリブロックをCellとして管理する
-     ことから，sizeof(Cell) 以上でなければならない．*/
-    const u_int	nblocks = Page::nbytes2nblocks(size);
-    if (nblocks == 0)
-	throw std::domain_error("TU::Object::operator new\tToo large memory requirement!!");
-    Page::Cell*	cell;
-    if ((cell = Page::Cell::find(nblocks)) == 0)
+    const size_t	nbytes = nblocks * sizeof(Page::Block);
+    if (_chunks.empty() || _chunks.back().top + nbytes > _chunks.back().end)
+    {
+	Page* const	page  = Page::region();
+	char* const	begin = (char*)&page->_block[0];
+	const Chunk	chunk = {begin, begin, begin + sizeof(page->_block)};
+	_chunks.push_back(chunk);
+    }
+    Chunk&	chunk = _chunks.back();
+    Page::Cell*	cell  = new(chunk.top) Page::Cell(nblocks);
+    chunk.top += nbytes;
+    return cell;
+}
+
+//! 開いている全ての領域内のオブジェクトの印を外す
+/*!
+  領域はsweepされないので，GCの度に印を外しておかないと，次のGCでその
+  先のオブジェクトを辿れなくなる．
+*/
+void
+RegionScope::unmark()
+{
+    for (RegionScope* scope = _cur; scope != 0; scope = scope->_prv)
+	unmark(scope->_chunks);
+}
+
+//! 指定されたchunk内のオブジェクトの印を外す
+/*!
+  chunkのページの生存block数も0に戻す．
+  \return	印が付いていたオブジェクトの数．
+*/
+u_int
+RegionScope::unmark(const std::vector<Chunk>& chunks)
+{
+    u_int	n = 0;
+    for (size_t i = 0; i < chunks.size(); ++i)
     {
+	Page::page(chunks[i].begin)->_live = 0;
+	for (Page::Cell* cell = (Page::Cell*)chunks[i].begin;
+	     cell < (Page::Cell*)chunks[i].top; cell = cell->forward())
+	    if (cell->marked())
+	    {
+		cell->unmark();
+		++n;
+	    }
+    }
+    return n;
+}
+
+/*
+ *  CellBatch::allocate()
+ */
+//! 指定された大きさのオブジェクトのためのメモリを作業スレッドに貸し出す
+/*!
+  \param size		オブジェクトの大きさ(byte数)．
+  \param finalizable	trueならば Finalizer に登録する．
+  \return		確保されたメモリ．
+*/
+void*
+CellBatch::allocate(size_t size, bool finalizable)
+{
+    const size_t	stride = Object::cellsize(size);
+    Run&		run    = _runs[stride];
+    if (run.n == 0)
+    {
+	std::lock_guard<std::mutex>	lock(_mtx);
+	run.n = NCELLS;
+	run.p = (char*)Object::allocate(size, run.n);
+    }
+    void* const	p = run.p;
+    run.p += stride;
+    --run.n;
+    if (finalizable)
+    {
+	std::lock_guard<std::mutex>	lock(_mtx);
+	Finalizer::enroll(p);
+    }
+    return p;
+}
+
+/*
+ *  Array::createSpine()
+ */
+//! 少なくとも指定された数の要素を持つ2段構成の格納領域を生成する
+/*!
+  nがLEAFSIZ以下ならば要素数nの葉を1つ，そうでなければ要素数LEAFSIZの
+  葉を必要なだけ持つspineを返す．
+  \param n	要素数．
+  \param spine	0でなければその要素を新しい格納領域に引き継ぐ．既に
+		LEAFSIZ個の要素を持つ葉は複写せずにそのまま共有する．
+  \return	新しいspine．
+*/
+Ptr<Array>
+Array::createSpine(u_int n, const Array* spine)
+{
+    const u_int	nleaves = (n > LEAFSIZ ? (n + LEAFSIZ - 1) / LEAFSIZ : 1);
+    Ptr<Array>	top = create(nleaves);
+    u_int	k = 0;
+    if (spine != 0 && leaf(spine, 0)->_n == LEAFSIZ)
+	for (; k < spine->_n && k < nleaves; ++k)
+	    top->_p[k] = spine->_p[k];		// Share the full leaves.
+    for (u_int j = k; j < nleaves; ++j)
+	top->_p[j] = create(nleaves > 1 ? u_int(LEAFSIZ) : n);	// may cause GC
+    if (k == 0)
+	for (u_int i = 0, m = std::min(capacity(spine), capacity(top));
+	     i < m; ++i)
+	    at(top, i) = at(spine, i);
+    return top;
+}
+
+/*
+ *  Object::mark(), collect(), new(), allocate(), save(), snapshot(), eoc(),
+ *  restore(), copy(), parallelCopy()
+ */
+void
+Object::mark() const
+{
+    if (!null() && !Page::marked(this))
+	mark(classDesc());
+}
+
+//! 指定された記述子に従って自身とそこから到達可能なオブジェクトに印を付ける
+/*!
+  StackScanner は構築途中かもしれないオブジェクトに対して，クラスIDを
+  キャッシュしない Object::currentDesc() の記述子を渡す．自身から辿ら
+  れるオブジェクトは classDesc() に従う．
+  \param desc	自身の記述子．
+*/
+void
+Object::mark(const Desc& desc) const
+{
+    static std::vector<const Object*>	stack;	// avoid deep recursion
+    
+    const auto	push = [](const Object* obj)
+		       {
+			   return [obj](u_int i)
+			   {
+			       Object*	child = obj->slot(i);
+			       if (child != 0 && !Page::marked(child))
+			       {
+				   Page::mark(child);
+				   stack.push_back(child);
+			       }
+			   };
+		       };
+    Page::mark(this);
+    desc.trace(this, push(this));
+    while (!stack.empty())
+    {
+	const Object*	obj = stack.back();
+	stack.pop_back();
+	obj->classDesc().trace(obj, push(obj));
+    }
+}
+
+//! 到達不能になったオブジェクトのデストラクタを実行する
+/*!
+  GCによって待ち行列に入れられたオブジェクトのうち，最大で指定された
+  数だけのデストラクタを呼び出し側のスレッドで実行する．デストラクタが
+  実行されたオブジェクトのメモリは次のGCで回収される．実行中はGCが
+  排他されるので，デストラクタはオブジェクトを確保してはならない．
+  \param max	デストラクタを実行するオブジェクト数の上限．
+  \return	実際にデストラクタを実行したオブジェクト数．
+*/
+u_int
+Object::finalize(u_int max)
+{
+    return Finalizer::run(max);
+}
+
+//! デストラクタを実行する専用のスレッドを起動する
+/*!
+  以後，GCによって待ち行列に入れられたオブジェクトのデストラクタは
+  このスレッドで実行される．GCとは排他されるが，mutatorとは並行して
+  走るので，デストラクタはオブジェクトを確保したり Ptr を生成したりして
+  はならない．
+*/
+void
+Object::startFinalizer()
+{
+    Finalizer::start();
+}
+
+//! デストラクタを実行する専用のスレッドを停止する
+void
+Object::stopFinalizer()
+{
+    Finalizer::stop();
+}
+
+//! ヘッダにキャッシュされたクラスIDから記述子を引く
+/*!
+  クラスIDがまだキャッシュされていなければ仮想関数 desc() を呼んで求め，
+  ヘッダに収まる値ならばキャッシュする．
+*/
+const Object::Desc&
+Object::classDesc() const
+{
+    if (_cid != 0)
+	return Desc::find(_cid);
+    const Desc&	d = desc();
+    if (d.id() < (1u << CID_BITS))
+	const_cast<Object*>(this)->_cid = d.id();
+    return d;
+}
+
+//! vtableへのポインタから記述子を引く．クラスIDはキャッシュしない
+/*!
+  構築途中のオブジェクトのvtableは基底クラスのものなので，そのクラスID
+  をヘッダにキャッシュしてしまうと，以後のmarkingが派生クラスのメンバを
+  辿らなくなる．構築が済んだか否かが分からないオブジェクトにはこちらを
+  用いる．
+*/
+const Object::Desc&
+Object::currentDesc() const
+{
+    return (_cid != 0 ? Desc::find(_cid) : desc());
+}
+
+//! ごみ集めを行う
+/*!
+  \return	回収したblock数．
+*/
+u_int
+Object::collect()
+{
+    using namespace	std;
+    
 #ifdef TUObjectPP_DEBUG
-	cerr << "TU::Object::operator new\tGarbage collection!!" << endl;
+    cerr << "TU::Object::collect\tGarbage collection!!" << endl;
 #endif
-        PtrBase::mark();
-	u_int	garbage = Page::sweep();	  
+    Finalizer::Lock	lock;		// No destructors run during GC.
+    PtrBase::mark();
+    PersistentHeap::mark();		// Mark from the root directory.
+    StackScanner::mark();		// Mark from the stack if scanning.
+    WeakTable::markAll();		// Mark values of live weak keys.
+    WeakBase::clear();			// Clear weak refs to dead objects
+    WeakTable::clearAll();		// before sweeping them.
+    HeapProfiler::scan();		// Record survival of samples.
+    Finalizer::scan();			// Keep dead finalizables until run.
+    RegionScope::unmark();		// Regions are not swept.
+    u_int	garbage = Page::sweep();	  
 #ifdef TUObjectPP_DEBUG
-	cerr << "TU::Object::operator new\t" << garbage << " blocks collected."
-	     << endl;
+    cerr << "TU::Object::collect\t" << garbage << " blocks collected."
+	 << endl;
 #endif
-	if ((cell = Page::Cell::find(nblocks)) == 0)
+    return garbage;
+}
+
+//! 指定されたblock数のcellをfree listから切り出す
+/*!
+  みつからなければGCを行い，それでもみつからなければ新たなpageを確保する．
+  \param nblocks	block数．
+  \return		切り出されたcell．
+*/
+static Page::Cell*
+getCell(u_int nblocks)
+{
+    using namespace	std;
+
+    Page::Cell*	cell;
+    if ((cell = Page::Cell::take(nblocks)) == 0)
+    {
+	if (!GCInhibitor::inhibited())
+	{
+	    Object::collect();
+	    cell = Page::Cell::take(nblocks);
+	}
+	if (cell == 0)
 	{
 #ifdef TUObjectPP_DEBUG
 	    cerr << "TU::Object::operator new\tGet new Page!!" << endl;
 #endif
 	    new Page;
-	    if ((cell = Page::Cell::find(nblocks)) == 0)
+	    if ((cell = Page::Cell::take(nblocks)) == 0)
 		throw std::bad_alloc();
 	}
 #ifdef TUObjectPP_DEBUG
 	cerr << endl;
 #endif
     }
-    cell->detach()->split(nblocks)->add();
-    return cell->clean();
+    if (Page::Cell* rest = cell->split(nblocks))
+	rest->add();
+    return cell;
+}
+
+void*
+Object::operator new(size_t size)
+{
+  /* 要求サイズをbyte単位からblock単位に変更する．nblocks * sizeof(Block)
+     は size 以上であることはもちろん，メモリブロックをCellとして管理する
+     ことから，sizeof(Cell) 以上でなければならない．*/
+    if (CellBatch* batch = CellBatch::current())
+	return batch->allocate(size, false);
+
+    const u_int	nblocks = Page::nbytes2nblocks(size);
+    if (nblocks == 0)
+	throw std::domain_error("TU::Object::operator new\tToo large memory requirement!!");
+    Page::Cell*	cell = (RegionScope::_cur != 0 ?
+			    (Page::Cell*)RegionScope::_cur->allocate(nblocks)
+			    : getCell(nblocks));
+    void*	p = cell->clean();
+    HeapProfiler::count(p, size);
+    return p;
+}
+
+//! 終了処理を要するクラスのオブジェクトのためのメモリを確保する
+/*!
+  確保したメモリはFinalizerに登録され，オブジェクトが到達不能になると
+  そのデストラクタが実行される．DECLARE_FINALIZABLE によって定義される
+  operator new から呼ばれる．デストラクタを確実に実行するため，
+  RegionScope の中でもGCが管理するpageから確保される．ただし，
+  PersistentHeap がvtableを得るための試作品は RegionScope から確保され，
+  登録もされない．
+*/
+void*
+Object::newFinalizable(size_t size)
+{
+    if (PersistentHeap::_prototyping)	// Never finalized.
+	return Object::operator new(size);
+    if (CellBatch* batch = CellBatch::current())
+	return batch->allocate(size, true);
+
+    const u_int	nblocks = Page::nbytes2nblocks(size);
+    if (nblocks == 0)
+	throw std::domain_error("TU::Object::newFinalizable\tToo large memory requirement!!");
+    void*	p = getCell(nblocks)->clean();
+    HeapProfiler::count(p, size);
+    return Finalizer::enroll(p);
+}
+
+//! 同じ大きさの複数のオブジェクトのためのメモリを一度に確保する
+/*!
+  確保された各メモリは cellsize(size) byte毎に連続して並ぶ．1つのpage
+  に収まらない個数が要求された場合は，収まる個数だけが確保される．
+  \param size	1つのオブジェクトの大きさ(byte数)．
+  \param n	確保するオブジェクト数．実際に確保された数が返される．
+  \return	最初のオブジェクトのためのメモリ．
+*/
+void*
+Object::allocate(size_t size, u_int& n)
+{
+    const u_int	nblocks = Page::nbytes2nblocks(size);
+    if (nblocks == 0)
+	throw std::domain_error("TU::Object::allocate\tToo large memory requirement!!");
+    if (n > Page::maxblocks() / nblocks)
+	n = Page::maxblocks() / nblocks;
+    if (n == 0)
+	n = 1;
+
+    Page::Cell* const	head = (RegionScope::_cur != 0 ?
+				    (Page::Cell*)RegionScope::_cur
+						->allocate(n * nblocks)
+				    : getCell(n * nblocks));
+    for (Page::Cell* cell = head; cell != 0; )
+    {
+	Page::Cell*	rest = cell->split(nblocks);
+	cell->clean();
+	cell = rest;
+    }
+    HeapProfiler::count(head, n * size);
+    return head;
+}
+
+size_t
+Object::cellsize(size_t size)
+{
+    return Page::nbytes2nblocks(size) * sizeof(Page::Block);
 }
 
 std::ostream&
@@ -82,15 +637,90 @@ Object::save(std::ostream& out) const
     {
 	objID = SaveMap::insert(this);			// get new objID for me
       	out.write((char*)&objID, sizeof(objID));
-	u_short classID = desc().id();			// get my classID
+	const Desc&	d = desc();
+	u_short classID = d.id();			// get my classID
       	out.write((char*)&classID, sizeof(classID));
+	if (d.variable())				// save array size
+	{
+	    const u_int	n = d.nvar(this);
+	    out.write((char*)&n, sizeof(n));
+	}
+	for (size_t i = 0; i < d.pod().size(); ++i)	// save POD members
+	    out.write((const char*)this + d.pod()[i].off, d.pod()[i].len);
 	saveGuts(out);					// save data members
-	for (const Mbrp* p = desc().mbrp(); *p != 0; )
-	    (this->*(*p++))->save(out);			// save recursively
+	for (const u_int* s = d.slot(); *s != 0; )
+	    slot(*s++)->save(out);			// save recursively
+	for (u_int k = 0; k < d.narrays(); ++k)
+	    for (u_int i = d.array(k), end = i + d.count(this, k); i < end; )
+		slot(i++)->save(out);
     }
     return out;
 }
 
+//! 自身から到達可能なオブジェクトをバックグラウンドでファイルに保存する
+/*!
+  fork() によって子プロセスを生成し，子プロセスがcopy-on-writeで複製さ
+  れたheapから自身をファイルに保存する．親プロセスは直ちに戻るので，保存
+  中もオブジェクトの変更や新たな確保を続けることができ，しかも保存される
+  のは呼び出し時点におけるグラフそのものである．SaveMapによるマークも子
+  プロセスのheapに対してのみ行われる．
+
+  fork() の間は Finalizer::Lock と CellBatch::Lock を保持するので，子
+  プロセスのheapが専用スレッドによるデストラクタの実行途中や作業スレッ
+  ドによる切り出しの途中の状態で複製されることはない．ReadAheadBuf の
+  先読みスレッドはGCの管理するheapに触れないので排他しない．
+  \param file	保存先のファイル名．
+  \return	保存が成功したか否かを保存終了時に返すfuture．
+*/
+std::future<bool>
+Object::snapshot(const char* file) const
+{
+    std::promise<bool>	done;
+    std::future<bool>	result = done.get_future();
+    pid_t		pid;
+    {
+	Finalizer::Lock	finalizerLock;	// Fork only at a safepoint of the
+	CellBatch::Lock	batchLock;	// library threads.
+	pid = fork();
+    }
+
+    if (pid < 0)
+	throw std::runtime_error("TU::Object::snapshot\tfork() failed!!");
+    if (pid == 0)				// child process
+    {
+	int	status = 1;
+	try
+	{
+	    std::ofstream	out(file, std::ios::out | std::ios::binary);
+	    save(out) << eoc;
+	    out.close();
+	    if (out)
+		status = 0;
+	}
+	catch (...)
+	{
+	}
+	_exit(status);				// don't run parent's cleanups
+    }
+
+  // Wait for the child in a detached thread so that discarding the
+  // returned future never blocks the caller.
+    std::thread([pid](std::promise<bool> done)
+		{
+		    int	status;
+		    while (waitpid(pid, &status, 0) < 0)
+			if (errno != EINTR)
+			{
+			    done.set_value(false);
+			    return;
+			}
+		    done.set_value(WIFEXITED(status) &&
+				   WEXITSTATUS(status) == 0);
+		}, std::move(done)).detach();
+
+    return result;
+}
+
 std::ostream&
 eoc(std::ostream& out)					// end of context
 {
@@ -104,23 +734,10 @@ eoc(std::ostream& out)					// end of context
 Object*
 Object::restoreObject(std::istream& in)
 {
-    Ptr<Object>	obj;
-    u_long		objID;
-
-    if (!in.read((char*)&objID, sizeof(objID)) || objID == Eoc)
-	RestoreMap::reset();
-    else if ((obj = RestoreMap::find(objID)) == (Object*)NotFound)
-    {							// not read yet
-	obj = 0;					// for GC.
-	u_short	classID;
-	in.read((char*)&classID, sizeof(classID));
-	obj = Desc::newObject(classID);
-	RestoreMap::insert(obj);
-	obj->restoreGuts(in);				// restore data members
-	for (const Mbrp* p = obj->desc().mbrp(); *p != 0; )
-	    obj->*(*p++) = restoreObject(in);		// restore recursively
-    }
-    return obj;
+    Restorer	restorer(in);
+    while (!restorer(~0))
+	;
+    return restorer.result();
 }
 
 Object*
@@ -133,12 +750,237 @@ Object::copyObject(u_int depth) const
 	obj = 0;					// for GC
 	obj = clone();
 	CopyMap::insert(this, obj);
-	for (const Mbrp* p = desc().mbrp(); *p != 0; ++p)
-	    obj->*(*p) = (this->*(*p))->copyObject(depth + 1);
+	classDesc().trace(this, [this, &obj, depth](u_int i)
+			  {
+			      const Object*	child = slot(i);
+			      obj->slot(i) = (child != 0 ?
+					      child->copyObject(depth + 1) : 0);
+			  });
     }
     if (depth == 0)
 	CopyMap::reset();
     return obj;
 }
+
+//! 自身から到達可能なオブジェクトを複数のスレッドを用いて深くコピーする
+/*!
+  次の3段階で行う．
+  -# 複数のスレッドでグラフを分担して辿り，共有されたオブジェクトや循環
+     があっても各オブジェクトがちょうど1回だけ登録されるように，並行アク
+     セス可能なmapに登録する．
+  -# 複数のスレッドで登録された各オブジェクトを clone() で複製する．各スレッ
+     ドは CellBatch を介して同じ大きさのcellをまとめて確保し，ロックせず
+     に使う．複製は根から到達できないので，その間はGCを抑制する．
+  -# 複数のスレッドで複製のポインタメンバを対応する複製に付け替える．
+
+  clone() は作業スレッドで呼ばれるので，Ptr を生成するなど共有の状態に
+  触れてはならない．RegionScope の中では複製を単一スレッドで行う．
+  \param nthreads	スレッド数．1以下ならば copyObject() と同じ．
+  \return		自身の複製．
+*/
+Object*
+Object::parallelCopyObject(u_int nthreads) const
+{
+    using namespace	std;
+    
+    if (nthreads <= 1)
+	return copyObject(0);
+
+    ParallelCopyMap	map(16 * nthreads);
+    vector<const Object*>	objs;		// all objects to be copied.
+
+  // Step 1: Traverse the graph. First, expand it serially in breadth-first
+  //	     order until the frontier is wide enough to keep all the threads
+  //	     busy. Then let each thread search its own part depth-first.
+    map.insert(this);
+    objs.push_back(this);
+    size_t	head = 0;
+    while (head < objs.size() && objs.size() - head < 4 * nthreads)
+    {
+	const Object*	obj = objs[head++];
+	obj->classDesc().trace(obj, [&](u_int i)
+			       {
+				   const Object*	child = obj->slot(i);
+				   if (child != 0 && map.insert(child))
+				       objs.push_back(child);
+			       });
+    }
+    vector<vector<const Object*> >	found(nthreads);
+    vector<thread>			threads;
+    for (u_int t = 0; t < nthreads; ++t)
+	threads.push_back(thread([&, t]()
+	{
+	    vector<const Object*>	stack;
+	    for (size_t i = head + t; i < objs.size(); i += nthreads)
+		stack.push_back(objs[i]);
+	    while (!stack.empty())
+	    {
+		const Object*	obj = stack.back();
+		stack.pop_back();
+		obj->classDesc().trace(obj, [&](u_int i)
+		{
+		    const Object*	child = obj->slot(i);
+		    if (child != 0 && map.insert(child))
+		    {
+			found[t].push_back(child);
+			stack.push_back(child);
+		    }
+		});
+	    }
+	}));
+    for (u_int t = 0; t < nthreads; ++t)
+    {
+	threads[t].join();
+	objs.insert(objs.end(), found[t].begin(), found[t].end());
+    }
+    threads.clear();
+    
+  // Step 2: Clone all the objects. The clones are not reachable from any
+  //	     root until step 3 has been finished, so GC must be suppressed.
+  //	     Regions are not thread-safe, so clone serially in a region.
+    GCInhibitor		inhibitor;
+    const size_t	chunk = (objs.size() + nthreads - 1) / nthreads;
+    if (RegionScope::_cur != 0)
+	for (size_t i = 0; i < objs.size(); ++i)
+	    map[objs[i]] = objs[i]->clone();
+    else
+    {
+	vector<exception_ptr>	errors(nthreads);
+	for (u_int t = 0; t < nthreads; ++t)
+	    threads.push_back(thread([&, t]()
+	    {
+		try
+		{
+		    CellBatch	batch;
+		    for (size_t i = t * chunk,
+				end = min(i + chunk, objs.size()); i < end; ++i)
+			map[objs[i]] = objs[i]->clone();
+		}
+		catch (...)
+		{
+		    errors[t] = current_exception();
+		}
+	    }));
+	for (u_int t = 0; t < nthreads; ++t)
+	    threads[t].join();
+	threads.clear();
+	for (u_int t = 0; t < nthreads; ++t)
+	    if (errors[t])
+		rethrow_exception(errors[t]);
+    }
+
+  // Step 3: Redirect the pointer members of the clones to the clones.
+    for (u_int t = 0; t < nthreads; ++t)
+	threads.push_back(thread([&, t]()
+	{
+	    for (size_t i = t * chunk,
+			end = min(i + chunk, objs.size()); i < end; ++i)
+	    {
+		const Object*	obj = objs[i];
+		Object*		dst = map[obj];
+		obj->classDesc().trace(obj, [&](u_int i)
+		{
+		    const Object*	child = obj->slot(i);
+		    dst->slot(i) = (child != 0 ? map[child] : 0);
+		});
+	    }
+	}));
+    for (u_int t = 0; t < nthreads; ++t)
+	threads[t].join();
+    
+    return map[this];
+}
+
+/*
+ *  Object::Restorer
+ */
+//! 指定された個数以下のオブジェクトを復元する
+/*!
+  復元は再帰を用いずに明示的なスタックで行われるので，長いリストを復元し
+  てもスタックが溢れることはない．復元途中のオブジェクトは全て根から到達
+  可能な状態に保たれるので，呼び出しの合間にGCが生じても安全である．
+  \param nobjs	今回の呼び出しで新たに復元するオブジェクト数の上限．
+  \return	全てのオブジェクトを復元し終えたらtrueを返す．
+*/
+bool
+Object::Restorer::operator ()(u_int nobjs)
+{
+    u_int	n = 0;
+    
+    if (!_started)
+    {
+	_started = true;
+	if (read(0, 0))
+	    ++n;
+    }
+    while (!_stack.empty())
+    {
+	Frame&	frame = _stack.back();
+	if (*frame.slot == 0 && frame.elm == frame.end)
+	{
+	    if (frame.arr == frame.desc->narrays())
+	    {
+		_stack.pop_back();
+		continue;
+	    }
+	    const u_int	k = frame.arr++;	// Proceed to the next array.
+	    frame.elm = frame.desc->array(k);
+	    frame.end = frame.elm + frame.desc->count(frame.obj, k);
+	    continue;
+	}
+	if (n == nobjs)
+	    return false;
+	Object*	parent = frame.obj;
+	u_int	slot   = (*frame.slot != 0 ? *frame.slot++ : frame.elm++);
+	if (read(parent, slot))				// may push a new frame
+	    ++n;
+    }
+    return true;
+}
+
+//! 1つのオブジェクトIDを読み込み，対応するオブジェクトを親のメンバに格納する
+/*!
+  \param parent	格納先のオブジェクト．0ならば根として格納する．
+  \param slot		格納先のメンバのword index．
+  \return		新たにオブジェクトを生成したらtrueを返す．
+*/
+bool
+Object::Restorer::read(Object* parent, u_int slot)
+{
+    u_long	objID;
+    Object*	obj;
+
+    if (!_in.read((char*)&objID, sizeof(objID)) || objID == Eoc)
+    {
+	RestoreMap::reset();
+	obj = 0;
+    }
+    else if ((obj = RestoreMap::find(objID)) == (Object*)NotFound)
+    {							// not read yet
+	u_short	classID;
+	_in.read((char*)&classID, sizeof(classID));
+	const Desc&	d = Desc::find(classID);
+	u_int		nvar = 0;
+	if (d.variable())				// read array size
+	    _in.read((char*)&nvar, sizeof(nvar));
+	obj = d.create(nvar);
+	if (parent != 0)				// make it reachable
+	    parent->slot(slot) = obj;				// from the root
+	else						// before GC may
+	    _obj = obj;					// happen.
+	RestoreMap::insert(obj);
+	for (size_t i = 0; i < d.pod().size(); ++i)	// restore POD members
+	    _in.read((char*)obj + d.pod()[i].off, d.pod()[i].len);
+	obj->restoreGuts(_in);				// restore data members
+	Frame	frame = {obj, &d, d.slot(), 0, 0, 0};
+	_stack.push_back(frame);			// restore members later
+	return true;
+    }
+    if (parent != 0)
+	parent->slot(slot) = obj;
+    else
+	_obj = obj;
+    return false;
+}
  
 }
@@ -3,82 +3,85 @@
  */
 #include "Object++_.h"
 #include <stdexcept>
+#include <cstdlib>
+#include <algorithm>
 
 namespace TU
 {
 /************************************************************************
 *  class Page::Cell:		memory cells assigned to the objects	*
 ************************************************************************/
-//! 指定されたblock数以上の大きさを持つcellをfree listから探す
+//! 指定されたblock数以上の大きさを持つ最小のcellをfree listから取り出す
 /*!
   \param nblocks	block数．
-  \param addition	falseならば，指定されたblock数以上のcellがみつかる
-			まで全てのfree listを探索する．trueならば，指定され
-			たblock数を格納するのにふさわしいfree listのみを探索
-			し，格納位置の直後のcellを返す．
   \return		みつかったcellを返す．みつからなければ0を返す．
 */
 Page::Cell*
-Page::Cell::find(u_int nblocks, bool addition)
+Page::Cell::take(u_int nblocks)
 {
-  // Find i s.t. 2^i <= nblocks - 1 < 2^(i+1).
-    u_int	i = 0;
-    for (u_int n = nblocks - 1; n >>= 1; )
-	++i;
-    
   // Search for the smallest cell of size greater than nblocks.
-    for (; i < TBLSIZ; ++i)
-    {
-	_head[i]._nb = nblocks;			// sentinel.
-	Cell*	cell = _head[i]._nxt;
-	while (cell->_nb < nblocks)
-	    cell = cell->_nxt;
-	if (addition || cell != &_head[i])
-	    return cell;
-    }
+    for (u_int i = index(nblocks); i < TBLSIZ; ++i)
+	for (Cell** p = &_head[i]; *p != 0; p = &(*p)->_nxt)
+	    if ((*p)->_h._nb >= nblocks)
+	    {
+		Cell*	cell = *p;
+		*p = cell->_nxt;		// Unlink it.
+		return cell;
+	    }
     return 0;
 }
 
-//! 自身をfree listに格納する
+//! 全てのfree listを空にする
 /*!
-  各free listの中でcellはその大きさ(block数)の昇順に格納される．this == 0
-  も許され，もちろんこの場合は何もしない．
-  \return	this != 0の場合は自身のblock数が返される．this == 0の場合
-		は0が返される．
+  sweepは全てのpageを走査してfree listを作り直すので，その前に呼ばれる．
 */
-u_int
-Page::Cell::add()
+void
+Page::Cell::clear()
 {
-    if (this)
-    {
-	Cell* cell = find(_nb, true);
-	_nxt = cell;
-	_prv = cell->_prv;
-	_prv->_nxt = _nxt->_prv = this;
-	_fr = 1;
-
-	return _nb;
-    }
-    else
-	return 0;
+    for (u_int i = 0; i < TBLSIZ; ++i)
+	_head[i] = 0;
 }
-    
-//! 自身をfree listから取り出す
+
+//! 他のfree listに含まれるcellを大きさの順序を保って併合する
 /*!
-  free listに格納されていることを表すフラグ_frが1の時のみ，実際の取り出し
-  が起こり，もちろんこの時は_frが0に書き換えられる．
-  \return	自分自身が返される．
+  並列にsweepしたスレッド毎のfree listを1つにまとめるために用いる．
+  \param head	併合するfree listの先頭の表．
 */
-Page::Cell*
-Page::Cell::detach()
+void
+Page::Cell::splice(Cell* const head[])
 {
-    if (_fr)
+    for (u_int i = 0; i < TBLSIZ; ++i)
     {
-	_nxt->_prv = _prv;
-	_prv->_nxt = _nxt;
-	_fr = 0;
+	Cell**	p = &_head[i];
+	for (Cell* q = head[i]; q != 0; )
+	{
+	    while (*p != 0 && (*p)->_h._nb <= q->_h._nb)
+		p = &(*p)->_nxt;
+	    Cell* const	cell = q;
+	    q	       = q->_nxt;
+	    cell->_nxt = *p;
+	    *p	       = cell;
+	    p	       = &cell->_nxt;
+	}
     }
-    return this;
+}
+
+//! 自身を指定されたfree listに格納する
+/*!
+  各free listの中でcellはその大きさ(block数)の昇順に格納される．
+  \param head	free listの先頭の表．
+  \return	自身のblock数．
+*/
+u_int
+Page::Cell::add(Cell* head[])
+{
+    Cell**	p = &head[index(_h._nb)];
+    while (*p != 0 && (*p)->_h._nb < _h._nb)
+	p = &(*p)->_nxt;
+    _nxt = *p;
+    *p	 = this;
+
+    return _h._nb;
 }
     
 //! 自身を2つのcellに分割する
@@ -91,10 +94,10 @@ Page::Cell::detach()
 Page::Cell*
 Page::Cell::split(u_int nblocks)
 {
-    const u_int	rest = _nb - nblocks;
+    const u_int	rest = _h._nb - nblocks;
     if (rest < nbytes2nblocks(sizeof(Cell)))
 	return 0;
-    _nb = nblocks;
+    _h._nb = nblocks;
     Cell* cell = new(forward()) Cell(rest);
     return cell;
 }
@@ -105,19 +108,22 @@ Page::Cell::split(u_int nblocks)
   築する際に，そのオブジェクトの内部に他のオブジェクトへのポインタがあ
   ると，そのポインタの初期化が済んでいない時点でGCが生じた場合にポイン
   タにゴミの値が入っているためにmarkingが暴走する可能性がある．これを
-  防ぐために，cellの中身全体を自身へのポインタで埋めておく．
+  防ぐために，ヘッダ以外のcellの中身全体を0で埋めておく．
 */
 void*
 Page::Cell::clean()
 {
 #ifdef TUObjectPP_DEBUG
-    if (_gc || _fr)	// Must not be marked as in use or in freelist.
+    if (marked())	// Must not be marked as in use.
 	throw std::domain_error("Page::Cell::clean: dirty cell!!");
 #endif
-    for (Cell **p = &_prv, **q = (Cell**)forward(); p < q; )
+    page(this)->setStart(this);		// Now lent to the user.
+    PersistentHeap::touch(this);	// The file is no longer synced.
+    _nxt = 0;
+    _h._sv = _h._cp = 0;
+    _h._cid = 0;			// Class ID is known after construction.
+    for (Cell **p = (Cell**)(this + 1), **q = (Cell**)forward(); p < q; )
 	*p++ = 0;
-  /*    for (Cell **p = &_prv, **q = (Cell**)forward(); p < q; )
-	*p++ = this;*/
     return this;
 }
 
@@ -130,50 +136,217 @@ Page::Cell::clean()
   をcellとしてfree listに格納する．
 */
 Page::Page()
-    :_nxt(_root)
+    :Page(true)
+{
+}
+
+//! メモリページを確保する
+/*!
+  \param shared	trueならばGCの管理するページとしてページリストに登録し，
+		falseならば RegionScope 専用のページとして登録しない．
+*/
+Page::Page(bool shared)
+    :_nxt(0), _live(0), _mark(true)
 {
-    _root = this;			// Register myself to the page list.
+    static_assert(sizeof(Cell) == 2*sizeof(Cell*),
+		  "Page::Cell must be as small as two words!!");
+    std::fill_n(_start, NWORDS, 0);
+    if (shared)
+    {
+	_nxt  = _root;
+	_root = this;			// Register myself to the page list.
+	Cell*	cell = new(&_block[0]) Cell(NBLOCKS);
+	cell->add();
+    }
+}
+
+//! ページの大きさに整列したメモリを確保する
+/*!
+  これにより Page::page() がcellのアドレスからページを求められる．
+  PersistentHeap が開かれていれば，そのファイルから切り出す．
+*/
+void*
+Page::operator new(size_t size)
+{
+    if (void* p = PersistentHeap::allocate())
+	return p;
     
-    Cell*	cell = new(&_block[0]) Cell(NBLOCKS);
-    cell->add();
+    void*	p;
+    if (posix_memalign(&p, sizeof(Block)*NBLOCKS, size) != 0)
+	throw std::bad_alloc();
+    return p;
+}
+
+void
+Page::operator delete(void* p)
+{
+    if (!PersistentHeap::contains(p))	// Mapped pages live in the file.
+	free(p);
+}
+
+//! RegionScope 専用のページを取り出す
+/*!
+  以前に返却されたページがあればそれを再利用する．
+*/
+Page*
+Page::region()
+{
+    Page*	page = _spare;
+    if (page != 0)
+	_spare = page->_nxt;
+    else
+    {
+	void*	p;				// never from PersistentHeap
+	if (posix_memalign(&p, sizeof(Block)*NBLOCKS, sizeof(Page)) != 0)
+	    throw std::bad_alloc();
+	page = new(p) Page(false);
+    }
+    page->_nxt  = 0;
+    page->_live = 0;
+    std::fill_n(page->_start, NWORDS, 0);
+    return page;
+}
+
+//! RegionScope 専用のページを返却する
+void
+Page::release(Page* page)
+{
+    page->_nxt = _spare;
+    _spare = page;
 }
 
 //! 全てのメモリページをsweepして使用されていないcellを回収する
 /*!
+  free listは空にされた後，使用されていない連続したcellを併合したもの
+  から作り直される．markingが数えた生存block数により，全て生きている
+  ページは印の意味を反転するだけで，全て死んでいるページは1つのcellに
+  戻すだけで済ませる．残りのページは十分な数があれば複数のスレッドで
+  並列にsweepされ，スレッド毎に作られたfree listが最後に併合される．
   \return	回収したblock数を返す．
 */
 u_int
 Page::sweep()
 {    
-    u_int	nblocks = 0;
+    u_int		nblocks = 0;
+    std::vector<Page*>	pages;			// partially live pages
     
+    Cell::clear();
     for (Page* page = _root; page; page = page->_nxt)	// for all pages...
+    {
+	if (page->_live == NBLOCKS)		// 全て使用中．
+	    page->_mark = !page->_mark;		// 印の意味を反転するだけ．
+	else if (page->_live == 0)		// 全てゴミ．
+	{
+	    std::fill_n(page->_start, NWORDS, 0);
+	    nblocks += (new(&page->_block[0]) Cell(NBLOCKS))->add();
+	}
+	else
+	    pages.push_back(page);
+	page->_live = 0;
+    }
+
+    const u_int	nthreads = std::min(std::thread::hardware_concurrency(),
+				    u_int(pages.size() / PAGES_PER_THREAD));
+    if (nthreads <= 1)
+    {
+	for (size_t i = 0; i < pages.size(); ++i)
+	    nblocks += pages[i]->sweep(Cell::_head);
+    }
+    else
     {
 #ifdef TUObjectPP_DEBUG
-	std::cerr << "\tPage::sweep\tsweeping...." << std::endl;
+	std::cerr << "\tPage::sweep\tsweeping " << pages.size()
+		  << " pages by " << nthreads << " threads...." << std::endl;
 #endif
-	Cell	*garbage = 0;
-	for (Cell *cell = (Cell*)(&page->_block[0]),
-		  *end  = (Cell*)(&page->_block[NBLOCKS]);
-	     cell < end; cell = cell->forward())
-	    if (cell->_gc)		// 使用中．
-	    {
-		cell->_gc = 0;			// マークをはずすだけ．
-		nblocks += garbage->add();	// これまでに集めたゴミを格納．
-		garbage = 0;
-	    }
-	    else			// free listにあるか又はdangling状態．
-	    {
+	std::vector<Cell*>		heads(nthreads * Cell::TBLSIZ, 0);
+	std::vector<u_int>		counts(nthreads, 0);
+	std::vector<std::thread>	threads;
+	for (u_int t = 0; t < nthreads; ++t)
+	    threads.push_back(std::thread([&, t]()
+			      {
+				  Cell** const	head = &heads[t*Cell::TBLSIZ];
+				  for (size_t i = t; i < pages.size();
+				       i += nthreads)
+				  {
+				      if (i + nthreads < pages.size())
+					  __builtin_prefetch(
+					      pages[i + nthreads]->_block);
+				      counts[t] += pages[i]->sweep(head);
+				  }
+			      }));
+	for (u_int t = 0; t < nthreads; ++t)
+	{
+	    threads[t].join();
+	    Cell::splice(&heads[t*Cell::TBLSIZ]);
+	    nblocks += counts[t];
+	}
+    }
+    
+    return nblocks;
+}
+
+//! 指定されたアドレスを含む貸し出し中のcellを探す
+/*!
+  アドレス以前で最も近いcellの先頭を _start から求め，そのcellの範囲に
+  アドレスが含まれるかを調べる．
+  \param p	自身の内部のアドレス．
+  \return	みつかったcell．なければ0．
+*/
+Page::Cell*
+Page::find(const void* p) const
+{
+    const u_int	BITS = 8*sizeof(u_long);
+    const u_int	b    = (const Block*)p - _block;
+    if (b >= NBLOCKS)			// in the members after the blocks
+	return 0;
+    u_int	i    = b / BITS;
+    u_long	w    = _start[i] & (~u_long(0) >> (BITS - 1 - b % BITS));
+    while (w == 0)
+    {
+	if (i == 0)
+	    return 0;
+	w = _start[--i];
+    }
+    const u_int	s    = i*BITS + BITS - 1 - __builtin_clzl(w);
+    Cell* const	cell = (Cell*)&_block[s];
+    return (b < s + cell->nblocks() ? cell : 0);
+}
+
+//! 自身のcellを走査し，使用されていない連続したcellを併合して回収する
+/*!
+  \param head	回収したcellを格納するfree listの先頭の表．
+  \return	回収したblock数を返す．
+*/
+u_int
+Page::sweep(Cell* head[])
+{
 #ifdef TUObjectPP_DEBUG
-		if (cell->_nb == 0)
-		    std::cerr << "size 0 cell!!" << std::endl;
+    std::cerr << "\tPage::sweep\tsweeping...." << std::endl;
 #endif
-		cell->detach();			// free listにあれば取り出す．
-	      // これまでに集めたゴミとマージする．
-		garbage = (garbage ? garbage->merge() : cell);
-	    }
-	nblocks += garbage->add();
-    }
+    u_int	nblocks = 0;
+    Cell*	garbage = 0;
+    for (Cell *cell = (Cell*)(&_block[0]), *end = (Cell*)(&_block[NBLOCKS]);
+	 cell < end; cell = cell->forward())
+	if (cell->_h._gc == _mark)	// 使用中．
+	{
+	    cell->_h._gc = !_mark;		// マークをはずすだけ．
+	    if (garbage)			// これまでに集めたゴミを格納．
+		nblocks += garbage->add(head);
+	    garbage = 0;
+	}
+	else			// free listにあったか又はdangling状態．
+	{
+#ifdef TUObjectPP_DEBUG
+	    if (cell->nblocks() == 0)
+		std::cerr << "size 0 cell!!" << std::endl;
+#endif
+	  // これまでに集めたゴミとマージする．
+	    clearStart(cell);
+	    garbage = (garbage ? garbage->merge() : cell);
+	}
+    if (garbage)
+	nblocks += garbage->add(head);
+
     return nblocks;
 }
  
@@ -0,0 +1,316 @@
+/*
+ *  $Id$
+ */
+#include "Object++_.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace TU
+{
+/************************************************************************
+*  static data and functions						*
+************************************************************************/
+static const char	Magic[8] = {'T', 'U', 'O', 'b', 'j', 'H', 'p', '3'};
+
+//! 写像の先頭からk番目のpageまでのbyte数を返す
+/*!
+  pageはその大きさに整列していなければならないので，ヘッダの後および
+  各pageの間は整列の単位まで詰められる．
+  \param hdrsize	ヘッダのbyte数．
+  \param k		pageの番号．
+*/
+static size_t
+pageOffset(size_t hdrsize, u_int k)
+{
+    const size_t	align  = sizeof(Page::Block) * Page::maxblocks();
+    const size_t	stride = (sizeof(Page) + align - 1) / align * align;
+    return (hdrsize + align - 1) / align * align + k * stride;
+}
+
+/************************************************************************
+*  class PersistentHeap:	heap kept in a memory-mapped file	*
+************************************************************************/
+//! ファイルを開いて固定アドレスに写像し，以後のpageをそこから確保する
+/*!
+  ファイルが空ならば指定された大きさのpersistent heapとして初期化する．
+  既にpersistent heapであれば，記録されたクラスの配置を現在の記述子と
+  照合した上で，そのpageとオブジェクトを引き継ぐ．
+  \param path	ファイル名．
+  \param size	新たに作る場合のファイルのbyte数．既存のファイルで
+		あれば無視される．
+  \param base	写像するアドレス．作成時と同じでなければならない．
+*/
+void
+PersistentHeap::open(const char* path, size_t size, void* base)
+{
+    if (_hdr != 0)
+	throw std::domain_error("TU::PersistentHeap::open\tAlready opened!!");
+    if (Page::_root != 0)
+	throw std::domain_error("TU::PersistentHeap::open\tObjects have already been allocated!!");
+
+    const int	fd = ::open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+	throw std::runtime_error("TU::PersistentHeap::open\tCannot open the file!!");
+    struct stat	st;
+    if (fstat(fd, &st) != 0)
+    {
+	::close(fd);
+	throw std::runtime_error("TU::PersistentHeap::open\tCannot stat the file!!");
+    }
+    const bool	created = (st.st_size == 0);
+    if (!created)
+	size = st.st_size;
+    else if (size < pageOffset(sizeof(Header), 1) || ftruncate(fd, size) != 0)
+    {
+	::close(fd);
+	throw std::runtime_error("TU::PersistentHeap::open\tCannot extend the file!!");
+    }
+    void* const	p = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+	throw std::runtime_error("TU::PersistentHeap::open\tmmap() failed!!");
+    if (p != base)
+    {
+	munmap(p, size);
+	throw std::runtime_error("TU::PersistentHeap::open\tCannot map the file at the base address!!");
+    }
+
+    Header* const	hdr = (Header*)p;
+    try
+    {
+	if (created)
+	{
+	    memcpy(hdr->magic, Magic, sizeof(Magic));
+	    hdr->base   = base;
+	    hdr->size   = size;
+	    hdr->npages = 0;
+	    hdr->clean  = true;
+	}
+	else if (memcmp(hdr->magic, Magic, sizeof(Magic)) != 0 ||
+		 hdr->base != base || hdr->size != size)
+	    throw std::domain_error("TU::PersistentHeap::open\tNot a persistent heap mapped at this address!!");
+	else if (!hdr->clean)
+	    throw std::domain_error("TU::PersistentHeap::open\tNot synced after the last change!!");
+
+      // Validate the recorded layouts against the current descriptors.
+	for (u_int cid = 1; cid < NCLASSES; ++cid)
+	    if (hdr->desc[cid] != 0 &&
+		hdr->desc[cid] != Object::Desc::find(cid).fingerprint())
+		throw std::domain_error("TU::PersistentHeap::open\tClass layout has been changed!!");
+    }
+    catch (...)
+    {
+	munmap(p, size);
+	throw;
+    }
+
+    _hdr = hdr;
+    attach();
+}
+
+//! 現在のオブジェクトグラフを次回に引き継げるようファイルに書き出す
+/*!
+  GCを行った後，free list上のcellと構築済みのオブジェクトを区別できる
+  ようにヘッダを整え，各オブジェクトのクラスの配置をヘッダに記録する．
+  最後にファイルが整合していることを示す clean を立てる．
+*/
+void
+PersistentHeap::sync()
+{
+    typedef Page::Cell	Cell;
+
+    if (_hdr == 0)
+	throw std::domain_error("TU::PersistentHeap::sync\tNot opened!!");
+
+    Object::collect();
+
+  // Mark the free cells temporarily to tell them from objects.
+    for (u_int i = 0; i < Cell::TBLSIZ; ++i)
+	for (Cell* cell = Cell::_head[i]; cell != 0; cell = cell->_nxt)
+	    cell->_h._gc = Page::page(cell)->_mark;
+
+  // Check the class IDs before changing anything in the pages.
+    for (Page* page = Page::_root; page != 0; page = page->_nxt)
+	for (Cell *cell = (Cell*)(&page->_block[0]),
+		  *end  = (Cell*)(&page->_block[Page::NBLOCKS]);
+	     cell < end; cell = cell->forward())
+	    if (!cell->marked() && *(void**)cell != 0 &&
+		((const Object*)(const void*)cell)->classDesc().id()
+		>= NCLASSES)
+	    {
+		for (u_int i = 0; i < Cell::TBLSIZ; ++i)
+		    for (Cell* c = Cell::_head[i]; c != 0; c = c->_nxt)
+			c->unmark();
+		throw std::domain_error("TU::PersistentHeap::sync\tToo large class ID!!");
+	    }
+
+    for (Page* page = Page::_root; page != 0; page = page->_nxt)
+	for (Cell *cell = (Cell*)(&page->_block[0]),
+		  *end  = (Cell*)(&page->_block[Page::NBLOCKS]);
+	     cell < end; cell = cell->forward())
+	    if (cell->marked())			// free cell
+	    {
+		cell->unmark();
+		cell->_h._cid = 0;
+	    }
+	    else if (*(void**)cell != 0)	// constructed object
+	    {
+		const Object::Desc&
+		    desc = ((const Object*)(const void*)cell)->classDesc();
+		_hdr->desc[desc.id()] = desc.fingerprint();
+	    }
+	    else				// not constructed yet
+		cell->_h._cid = 0;
+
+    _hdr->clean = true;
+    if (msync(_hdr, _hdr->size, MS_SYNC) != 0)
+	throw std::runtime_error("TU::PersistentHeap::sync\tmsync() failed!!");
+}
+
+//! 指定された名前の根を返す
+/*!
+  \param name	根の名前．
+  \return	根となるオブジェクト．なければ0．
+*/
+Object*
+PersistentHeap::root(const char* name)
+{
+    if (_hdr == 0)
+	throw std::domain_error("TU::PersistentHeap::root\tNot opened!!");
+    for (u_int i = 0; i < NROOTS; ++i)
+	if (_hdr->root[i].obj != 0 &&
+	    strncmp(_hdr->root[i].name, name, NAMELEN) == 0)
+	    return _hdr->root[i].obj;
+    return 0;
+}
+
+//! 指定された名前の根を登録する
+/*!
+  \param name	根の名前．
+  \param obj	根となるオブジェクト．persistent heap内になければなら
+		ない．0ならば登録を取り消す．
+*/
+void
+PersistentHeap::root(const char* name, const Object* obj)
+{
+    if (_hdr == 0)
+	throw std::domain_error("TU::PersistentHeap::root\tNot opened!!");
+    if (strlen(name) >= NAMELEN)
+	throw std::domain_error("TU::PersistentHeap::root\tToo long name!!");
+    if (obj != 0 && !contains(obj))
+	throw std::domain_error("TU::PersistentHeap::root\tObject not in the persistent heap!!");
+
+    _hdr->clean = false;
+    Root*	vacant = 0;
+    for (u_int i = 0; i < NROOTS; ++i)
+    {
+	Root&	root = _hdr->root[i];
+	if (root.obj == 0)
+	{
+	    if (vacant == 0)
+		vacant = &root;
+	}
+	else if (strncmp(root.name, name, NAMELEN) == 0)
+	{
+	    root.obj = const_cast<Object*>(obj);
+	    return;
+	}
+    }
+    if (obj == 0)
+	return;
+    if (vacant == 0)
+	throw std::domain_error("TU::PersistentHeap::root\tRoot directory is full!!");
+    memcpy(vacant->name, name, strlen(name) + 1);
+    vacant->obj = const_cast<Object*>(obj);
+}
+
+//! 写像から新たなpageのためのメモリを切り出す
+/*!
+  \return	切り出したメモリ．開かれていなければ0．
+*/
+void*
+PersistentHeap::allocate()
+{
+    if (_hdr == 0)
+	return 0;
+
+    char* const	p = (char*)_hdr + pageOffset(sizeof(Header), _hdr->npages);
+    if (p + sizeof(Page) > (char*)_hdr + _hdr->size)
+	throw std::bad_alloc();
+    _hdr->clean = false;
+    ++_hdr->npages;
+    return p;
+}
+
+//! 根の表から到達可能なオブジェクトに印を付ける
+/*!
+  GCはpage内のcellを書き換えるので，ファイルは sync() されるまで整合し
+  ていないものとして扱われる．
+*/
+void
+PersistentHeap::mark()
+{
+    if (!_attached)
+	return;
+    _hdr->clean = false;
+    for (u_int i = 0; i < NROOTS; ++i)
+	if (_hdr->root[i].obj != 0)
+	    _hdr->root[i].obj->mark();
+}
+
+//! ファイル中のpageをページリストに戻し，vtableへのポインタを張り直す
+/*!
+  各クラスのvtableへのポインタは，RegionScope の中で一時的に生成した
+  そのクラスのオブジェクトから得る．終了処理を要するクラスのものも
+  _prototyping の間は RegionScope から確保され，Finalizer には登録され
+  ない．free listは空のままなので，最初の確保の際にGCが行われて作り直
+  される．
+*/
+void
+PersistentHeap::attach()
+{
+    typedef Page::Cell	Cell;
+
+    const u_int			npages = _hdr->npages;
+    std::vector<const void*>	vptr(NCLASSES, 0);
+    {
+	RegionScope	region;		// Prototypes are discarded at once.
+	_prototyping = true;
+	try
+	{
+	    for (u_int cid = 1; cid < NCLASSES; ++cid)
+		if (_hdr->desc[cid] != 0)
+		    vptr[cid] = *(const void* const*)Object::Desc::find(cid)
+								.create(0);
+	}
+	catch (...)
+	{
+	    _prototyping = false;
+	    throw;
+	}
+	_prototyping = false;
+    }
+
+    for (u_int k = 0; k < npages; ++k)
+    {
+	Page* const	page = (Page*)((char*)_hdr +
+				       pageOffset(sizeof(Header), k));
+	page->_nxt  = Page::_root;
+	page->_live = 0;
+	Page::_root = page;
+
+	for (Cell *cell = (Cell*)(&page->_block[0]),
+		  *end  = (Cell*)(&page->_block[Page::NBLOCKS]);
+	     cell < end; cell = cell->forward())
+	    if (cell->_h._cid != 0)
+		*(const void**)cell = vptr[cell->_h._cid];
+    }
+
+    _attached = true;
+}
+
+}
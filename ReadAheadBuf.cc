@@ -0,0 +1,109 @@
+/*
+ *  $Id$
+ */
+#include "TU/Object++.h"
+
+namespace TU
+{
+/************************************************************************
+*  class ReadAheadBuf:	stream buffer prefetching its source in a	*
+*			background thread				*
+************************************************************************/
+//! 指定されたstream bufferから先読みを行うstream bufferを生成する
+/*!
+  読み込みスレッドが大きなchunk単位でリング状に並んだバッファに先読みを
+  行うので，Object::restore() 等によるデコードとディスクI/Oが並行して
+  行われる．
+  \param src	読み込み元のstream buffer．
+  \param bufsiz	1つのバッファの大きさ(byte数)．
+  \param nbufs	リングを構成するバッファの数．
+*/
+ReadAheadBuf::ReadAheadBuf(std::streambuf* src, size_t bufsiz, u_int nbufs)
+    :_src(src), _buf(nbufs < 2 ? 2 : nbufs, std::vector<char>(bufsiz)),
+     _len(_buf.size(), 0), _head(0), _tail(0), _nfilled(0),
+     _inuse(false), _eof(false), _quit(false),
+     _reader(&ReadAheadBuf::fetch, this)
+{
+}
+
+//! 指定された入力ストリームから先読みを行うstream bufferを生成する
+/*!
+  \param in	読み込み元の入力ストリーム．
+  \param bufsiz	1つのバッファの大きさ(byte数)．
+  \param nbufs	リングを構成するバッファの数．
+*/
+ReadAheadBuf::ReadAheadBuf(std::istream& in, size_t bufsiz, u_int nbufs)
+    :ReadAheadBuf(in.rdbuf(), bufsiz, nbufs)
+{
+}
+
+ReadAheadBuf::~ReadAheadBuf()
+{
+    {
+	std::lock_guard<std::mutex>	lock(_mtx);
+	_quit = true;
+    }
+    _cond.notify_all();
+    _reader.join();
+}
+
+//! get領域を使い切ったら，次に先読みされたバッファに切り替える
+ReadAheadBuf::int_type
+ReadAheadBuf::underflow()
+{
+    std::unique_lock<std::mutex>	lock(_mtx);
+
+    if (_inuse)				// Return the consumed buffer
+    {					// to the reader thread.
+	_inuse = false;
+	_head  = (_head + 1) % _buf.size();
+	--_nfilled;
+	_cond.notify_all();
+    }
+    while (_nfilled == 0 && !_eof)
+	_cond.wait(lock);
+    if (_nfilled == 0)
+	return traits_type::eof();
+
+    char*	p = &_buf[_head][0];
+    setg(p, p, p + _len[_head]);
+    _inuse = true;
+
+    return traits_type::to_int_type(*p);
+}
+
+//! 読み込みスレッドの本体
+void
+ReadAheadBuf::fetch()
+{
+    for (;;)
+    {
+	u_int	tail;
+	{
+	    std::unique_lock<std::mutex>	lock(_mtx);
+	    while (_nfilled == _buf.size() && !_quit)
+		_cond.wait(lock);
+	    if (_quit)
+		return;
+	    tail = _tail;
+	}
+
+      // _buf[tail] is owned by this thread until it is counted as filled.
+	const std::streamsize	n = _src->sgetn(&_buf[tail][0],
+						_buf[tail].size());
+	std::lock_guard<std::mutex>	lock(_mtx);
+	if (n > 0)
+	{
+	    _len[tail] = n;
+	    _tail = (tail + 1) % _buf.size();
+	    ++_nfilled;
+	}
+	if (n < std::streamsize(_buf[tail].size()))
+	    _eof = true;
+	_cond.notify_all();
+	if (_eof)
+	    return;
+    }
+}
+
+}
@@ -0,0 +1,101 @@
+/*
+ *  $Id$
+ */
+#include "Object++_.h"
+#include <algorithm>
+#include <csetjmp>
+#include <pthread.h>
+
+namespace TU
+{
+/************************************************************************
+*  class StackScanner:	conservative scanner of the stack for roots	*
+************************************************************************/
+//! 呼び出したスレッドのスタックの走査を開始する
+/*!
+  以後このスレッドでGCが行われる度に，そのスタックとレジスタが走査され
+  る．
+*/
+void
+StackScanner::start()
+{
+    pthread_attr_t	attr;
+    void*		addr;
+    size_t		size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+	throw std::runtime_error("TU::StackScanner::start\tCannot get the stack of this thread!!");
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+
+    _base = (const char*)addr + size;
+    _tid  = std::this_thread::get_id();
+}
+
+//! スタックの走査を停止する
+void
+StackScanner::stop()
+{
+    _base = 0;
+}
+
+//! スタックとレジスタにあるポインタらしい語の指すオブジェクトに印を付ける
+/*!
+  callee-savedレジスタをこの関数のフレームに書き出させた後，それより
+  深いフレームから走査する．走査を開始したスレッド以外でGCが行われた
+  場合は何もしない．
+*/
+void
+StackScanner::mark()
+{
+    if (_base == 0 || std::this_thread::get_id() != _tid)
+	return;
+
+#ifdef __GNUC__
+    __builtin_unwind_init();		// Spill callee-saved registers.
+#endif
+    std::jmp_buf	regs;		// Also save them in a portable way.
+    setjmp(regs);
+    scan();
+}
+
+//! 呼び出し元以上のフレームの各語が貸し出し中のcellを指していれば印を付ける
+/*!
+  呼び出し元のフレームを確実に走査するためにインライン展開させない．
+  まだ構築されていないオブジェクトのcellは，辿らずに印だけを付ける．
+  構築途中かもしれないオブジェクトは，クラスIDをキャッシュせずに現在の
+  vtableが示す記述子に従って辿る．
+*/
+__attribute__((noinline)) void
+StackScanner::scan()
+{
+    typedef Page::Cell	Cell;
+    
+    std::vector<const Page*>	pages;
+    for (const Page* page = Page::_root; page != 0; page = page->_nxt)
+	pages.push_back(page);
+    for (RegionScope* scope = RegionScope::_cur; scope != 0;
+	 scope = scope->_prv)
+	for (size_t i = 0; i < scope->_chunks.size(); ++i)
+	    pages.push_back(Page::page(scope->_chunks[i].begin));
+    std::sort(pages.begin(), pages.end());
+    
+    for (const void* const* p = (const void* const*)__builtin_frame_address(0),
+			  * end = (const void* const*)_base; p < end; ++p)
+    {
+	const Page* const	page = Page::page(*p);
+	if (!std::binary_search(pages.begin(), pages.end(), page))
+	    continue;
+	Cell* const	cell = page->find(*p);
+	if (cell == 0 || cell->marked())
+	    continue;
+	if (*(void* const*)cell != 0)		// object, perhaps partially
+	{					// constructed
+	    const Object* const	obj = (const Object*)(const void*)cell;
+	    obj->mark(obj->currentDesc());	// Do not cache its class ID.
+	}
+	else
+	    Page::mark(cell);
+    }
+}
+
+}
@@ -7,6 +7,14 @@
 #include <sys/types.h>
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <type_traits>
+#include <stdexcept>
 
 namespace TU
 {
@@ -22,32 +30,71 @@ Mbrp const			MbrpEnd = 0;
 class PtrBase
 {
   public:
-    PtrBase(const PtrBase& q):_p(q._p), _nxt(_root)	{_root = this;}
-    PtrBase&	operator =(const PtrBase& q)		{_p=q._p;return *this;}
+    PtrBase(const PtrBase& q):_p(q._p), _idx(push(&_p, 1))	{}
+    PtrBase(PtrBase&& q) noexcept
+			     :_p(q._p), _idx(q._idx)
+						{
+						  if (_idx != NoSlot)
+						      _stack[_idx].p = &_p;
+						  q._p	 = 0;
+						  q._idx = NoSlot;
+						}
+    PtrBase&	operator =(const PtrBase& q)	{assign(q._p); return *this;}
     Object*&	operator ->*(Mbrp q)		const	{return _p->*q;}
 //		operator bool()			const	{return _p != 0;}
 //  bool	operator !()			const	{return _p == 0;}
     
   protected:
-    PtrBase(Object* obj)	 :_p(obj),  _nxt(_root)	{_root = this;}
-    ~PtrBase()						{
-							  if (_root == this)
-							    _root = _nxt;
-							  else
-							    _root->_nxt = _nxt;
-							}
+    PtrBase(Object* obj)	 :_p(obj), _idx(push(&_p, 1))	{}
+    ~PtrBase()						{pop(_idx);}
     void		operator delete(void*)		{}
+    void		assign(Object* obj)
+			{ // A moved-out pointer has no slot until assigned.
+			    if (_idx == NoSlot)
+				_idx = push(&_p, 1);
+			    _p = obj;
+			}
 
     Object*		_p;
 
   private:
+    enum		{NoSlot = ~0u};
+
+  //! 根となるポインタの連続した並び
+    struct Root
+    {
+	Object**	p;		// first pointer
+	u_int		n;		// # of pointers, 0 if released
+    };
+    
     void*		operator new(size_t)	; // prohibit heap allocation
 
+    static u_int	push(Object** p, u_int n)
+			{
+			    if (_top == _size)
+				grow();
+			    _stack[_top].p = p;
+			    _stack[_top].n = n;
+			    return _top++;
+			}
+    static void		pop(u_int idx)
+			{
+			    if (idx == NoSlot)		// moved out
+				return;
+			    _stack[idx].n = 0;		// Leave a hole and
+			    while (_top > 0 && _stack[_top - 1].n == 0)
+				--_top;			// shrink if on the top.
+			}
+    static void		grow()			;
     static void		mark()			;
 			
-    PtrBase*		_nxt;
-    static PtrBase*	_root;
+    u_int		_idx;			// index of my root entry
+    static Root*	_stack;			// stack of root entries
+    static u_int	_top;			// # of entries in use
+    static u_int	_size;			// capacity of _stack
 
+    template <class T, u_int N>
+    friend class	RootFrame;		// allow access to push/pop
     friend class	Object;			// allow access to mark()
 };
 
@@ -55,32 +102,82 @@ template <class T>	class Ptr : public PtrBase
 {
   public:
 		Ptr(T* obj=0)	:PtrBase(obj)		{}
+		Ptr(const Ptr& q) = default;
+		Ptr(Ptr&& q) noexcept :PtrBase(std::move(q))	{}
 
 		operator T*()			const	{return (T*)_p;}
-    Ptr&	operator = (T* obj)			{_p=obj; return *this;}
+    Ptr&	operator = (T* obj)		{assign(obj); return *this;}
+    Ptr&	operator = (const Ptr& q) = default;
     T*		operator ->()			const	{return (T*)_p;}
     bool	operator ==(T* obj)		const	{return _p == obj;}
     bool	operator !=(T* obj)		const	{return _p != obj;}
 };
 
+/************************************************************************
+*  class RootFrame<T, N>:	fixed number of root pointers in a scope	*
+************************************************************************/
+/*!
+  N個のポインタをまとめて1つの根として登録する．スコープ内で多数のオブ
+  ジェクトを保護する場合，個々に Ptr を用いるより登録と解除が安価で，GC
+  も連続した配列として走査する．ポインタは0に初期化される．
+*/
+template <class T, u_int N>
+class RootFrame
+{
+  public:
+    RootFrame()
+			{
+			    for (u_int i = 0; i < N; ++i)
+				_p[i] = 0;
+			    _idx = PtrBase::push(_p, N);
+			}
+    ~RootFrame()			{PtrBase::pop(_idx);}
+
+    T*&			operator [](u_int i)	{return (T*&)_p[i];}
+    T*			operator [](u_int i) const {return (T*)_p[i];}
+    u_int		size()		const	{return N;}
+    
+  private:
+    RootFrame(const RootFrame&)			;
+    RootFrame&		operator =(const RootFrame&)	;
+    void*		operator new(size_t)	; // prohibit heap allocation
+    
+    Object*		_p[N];
+    u_int		_idx;
+
+    static_assert(N > 0, "Empty root frame!!");
+};
+
 /************************************************************************
 *  Class Object:	base class of all object			*
 ************************************************************************/
+class Page;
+
+//! 全てのオブジェクトとcellに共通する1 wordのヘッダ
+/*!
+  仮想関数を持たないので，オブジェクトではvtableへのポインタの直後
+  (word 1)に，cellではfree listのリンクの直後に置かれる．_cid は記述子
+  を表から引くためにクラスIDを保持し，まだ分からなければ0である．
+*/
 class ObjectHeader
 {
   protected:
-    ObjectHeader()	   :_gc(0), _sv(0), _cp(0), _fr(0)		{}
-    ObjectHeader(u_int nb) :_gc(0), _sv(0), _cp(0), _fr(0), _nb(nb)	{}
+    enum	{CID_BITS = 11};
+    
+    ObjectHeader()	   :_sv(0), _cp(0)				{}
+    ObjectHeader(u_int nb) :_sv(0), _cp(0), _nb(nb), _cid(0)		{}
     ObjectHeader(const ObjectHeader&)
-			   :_gc(0), _sv(0), _cp(0), _fr(0)		{}
+			   :_sv(0), _cp(0)				{}
     ObjectHeader&	operator =(const ObjectHeader&)	{return *this;}
-    virtual		~ObjectHeader()			{}
 
-    unsigned	_gc	: 1;	// Object is alive. Don't sweep it !
+    unsigned	_gc	: 1;	// Alive if equal to Page::_mark of its page
     unsigned	_sv	: 1;	// Already saved in stream
     unsigned	_cp	: 1;	// Already deeply copied
-    unsigned	_fr	: 1;	// In free list of PAGE::CELL
-    unsigned	_nb	: 28;	// Object size in # of Page::Blocks
+    unsigned	_nb	: 17;	// Object size in # of Page::Blocks
+    unsigned	_cid	: CID_BITS;	// class ID cache, 0 if unknown
+
+    friend class	Page;		// allow Page::Cell to build headers
+    friend class	PersistentHeap;	// allow access to CID_BITS
 };
 
 class Object : private ObjectHeader
@@ -89,60 +186,302 @@ class Object : private ObjectHeader
     class Desc
     {
       private:
-	typedef std::map<u_short, Desc*>	Map;
 	typedef	Object*				(*Pftype)();
+	typedef	Object*				(*Pfntype)(u_int);
 
       public:
-	Desc(u_short, u_short, Pftype, ...)	;
+      //! 要素数を表すメンバを伴うポインタ配列
+	struct Counted
+	{
+	    u_int	cnt;			// byte offset of the count
+	    u_int	slot;			// word index of 1st element
+	    bool	trailing;		// placed at the end of object?
+	};
+      //! まとめて保存，復元される非ポインタメンバのbyte範囲
+	struct Guts
+	{
+	    u_int	off;			// byte offset
+	    u_int	len;			// # of bytes
+	};
+	
+      /*!
+	クラスID，基底クラスのID，生成関数およびGCの対象となるポインタメンバ
+	(Object派生クラスへのポインタ型のメンバ，またはその配列型のメンバへの
+	ポインタ)を登録する．配列型のメンバはその全要素が登録されるが，
+	counted() で指定すれば要素数を表すメンバの値だけ先頭から辿られる．
+	その要素数は saveGuts() と restoreGuts() で保存，復元すること．
+	guts() で指定した非ポインタメンバは，saveGuts() と restoreGuts()
+	に先立ってそのままのbyte列として一度に保存，復元される．メンバ
+	の型はコンパイル時に検査される．基底クラスのメンバは，各Descが静的
+	に初期化される順序に関わらず自身のメンバの前に併合される．
+      */
+	template <class... MBRP>
+	Desc(u_short id, u_short bid, Pftype pf, MBRP... mbrp)
+	    :_id(id), _bid(bid), _pf(pf), _pfn(0), _bm(0),
+	     _wide(false), _init(false), _nxt(0)
+	{
+	    const int	expand[] = {0, (add(mbrp), 0)...};
+	    (void)expand;
+	    setup();
+	}
+      /*!
+	末尾に可変長のポインタ配列を持つクラスを登録する．生成関数は配列の
+	要素数を引数にとる．配列は trailing() で指定し，その要素数は自動的に
+	保存，復元される．
+      */
+	template <class... MBRP>
+	Desc(u_short id, u_short bid, Pfntype pfn, MBRP... mbrp)
+	    :_id(id), _bid(bid), _pf(0), _pfn(pfn), _bm(0),
+	     _wide(false), _init(false), _nxt(0)
+	{
+	    const int	expand[] = {0, (add(mbrp), 0)...};
+	    (void)expand;
+	    setup();
+	}
 	~Desc()					;
 	u_short		id()		const	{return _id;}
-	const Mbrp*	mbrp()		const	{return _p;}
-	static Object*	newObject(u_short id)	{return (*_map)[id]->_pf();}
+	const u_int*	slot()		const	{return &_slot[0];}
+	bool		variable()	const	{return (!_arr.empty() &&
+							 _arr.back().trailing);}
+	u_int		nvar(const Object* obj) const
+			{
+			    return (variable() ? count(obj, _arr.size() - 1)
+					       : 0);
+			}
+	const std::vector<Guts>&
+			pod()		const	{return _guts;}
+	u_int		narrays()	const	{return _arr.size();}
+	u_int		array(u_int k)	const	{return _arr[k].slot;}
+	u_int		count(const Object* obj, u_int k) const
+			{
+			    return *(const u_int*)((const char*)obj +
+						   _arr[k].cnt);
+			}
+	template <class F>
+	void		trace(const Object* obj, F f)	const	;
+	Object*		create(u_int n)	const	{return (_pfn != 0 ?
+							 _pfn(n) : _pf());}
+	u_long		fingerprint()			const	;
+	static const Desc&
+			find(u_short id)
+			{
+			    if (id >= _ntbl || _tbl[id] == 0)
+				throw std::domain_error("TU::Object::Desc::find\tUnknown class ID!!");
+			    return *_tbl[id];
+			}
+	static Object*	newObject(u_short id)	{return find(id).create(0);}
 
-      private:    
-	u_int		nMbrp()		const	;
-	bool		setMbrp()		;
+      //! そのままのbyte列として保存，復元できる非ポインタメンバを指定する
+	template <class C, class M>
+	static Guts	guts(M C::* p)
+			{
+			    static_assert(std::is_trivially_copyable<M>::value,
+					  "Guts must be trivially copyable!!");
+			    static_assert(!std::is_pointer<M>::value,
+					  "Guts must not be a pointer!!");
+			    const Guts	g = {offset(p), sizeof(M)};
+			    return g;
+			}
+      //! 要素数を表すメンバと配列メンバから先頭の要素だけが有効な配列を指定する
+	template <class C, class T, size_t N>
+	static Counted	counted(u_int C::* n, T* (C::* p)[N])
+			{
+			    static_assert(std::is_base_of<Object, T>::value,
+					  "Array of pointers to a non-Object class!!");
+			    const Counted	arr = {offset(n), index(p), false};
+			    return arr;
+			}
+      //! 要素数を表すメンバと末尾の配列メンバから可変長配列を指定する
+	template <class C, class T, size_t N>
+	static Counted	trailing(u_int C::* n, T* (C::* p)[N])
+			{
+			    Counted	arr = counted(n, p);
+			    arr.trailing = true;
+			    return arr;
+			}
+
+      private:
+	Desc(const Desc&)			;
+	Desc&		operator =(const Desc&)	;
+
+	template <class C, class T>
+	void		add(T* C::* p)
+			{
+			    static_assert(std::is_base_of<Object, C>::value,
+					  "Member of a non-Object class!!");
+			    static_assert(std::is_base_of<Object, T>::value,
+					  "Pointer to a non-Object class!!");
+			    if (p != 0)		// Skip MbrpEnd if any.
+				_slot.push_back(index(p));
+			}
+	template <class C, class T, size_t N>
+	void		add(T* (C::* p)[N])
+			{
+			    static_assert(std::is_base_of<Object, C>::value,
+					  "Member of a non-Object class!!");
+			    static_assert(std::is_base_of<Object, T>::value,
+					  "Array of pointers to a non-Object class!!");
+			    for (u_int i = 0; i < N; ++i)
+				_slot.push_back(index(p) + i);
+			}
+	void		add(const Counted& arr)		;
+	void		add(const Guts& g)		;
+	template <class C, class M>
+	static u_int	offset(M C::* p)
+			{
+			  // Compute the offset from an address with no object
+			  // at all: the member is never accessed.
+			    static_assert(std::is_base_of<Object, C>::value,
+					  "Member of a non-Object class!!");
+			    const C* const	obj
+				= reinterpret_cast<const C*>(0x1000);
+			    return (const char*)&(obj->*p)
+				 - (const char*)static_cast<const Object*>(obj);
+			}
+	template <class C, class M>
+	static u_int	index(M C::* p)
+			{
+			    const u_int	off = offset(p);
+			    if (off % sizeof(Object*) != 0)
+				throw std::domain_error("TU::Object::Desc::index\tMisaligned pointer member!!");
+			    return off / sizeof(Object*);
+			}
+	void		setup()				;
+	void		merge(const Desc& base)		;
+	void		bitmap()			;
     
 	static u_int	_ndescs;		// # of descs
-	static Map*	_map;			// id -> desc looking-up
+	static Desc**	_tbl;			// id -> desc looking-up
+	static u_int	_ntbl;			// size of _tbl
+	static Desc*	_pending;		// descs waiting for its base
     
-	const u_short	_id;			// class ID of mine
-	const u_short	_bid;			// class ID of base
-	const Pftype	_pf;			// constructor
-	Mbrp*		_p;			// pointer members
-	bool		_init;
+	const u_short		_id;		// class ID of mine
+	const u_short		_bid;		// class ID of base
+	const Pftype		_pf;		// constructor
+	const Pfntype		_pfn;		// constructor with array size
+	std::vector<u_int>	_slot;		// word indices of pointer members
+	u_long			_bm;		// bitmap of _slot[]
+	bool			_wide;		// some of _slot[] >= 64 ?
+	std::vector<Counted>	_arr;		// counted arrays
+	std::vector<Guts>	_guts;		// POD members
+	bool			_init;		// base members merged?
+	Desc*			_nxt;		// next desc in _pending
     };
 
   public:
+  /*!
+    ストリームからオブジェクトを少しずつ復元するためのクラス．1回の呼び出
+    しで復元するオブジェクト数に上限を設けることにより，巨大なスナップ
+    ショットの読み込み中にも他の処理を行うことができる．
+  */
+    class Restorer
+    {
+      public:
+	Restorer(std::istream& in)
+	    :_in(in), _obj(0), _started(false)	{}
+
+	bool		operator ()(u_int nobjs)	;
+	Object*		result()		const	{return _obj;}
+
+      private:
+	struct Frame
+	{
+	    Object*		obj;		// object being restored
+	    const Desc*		desc;		// desc of the object
+	    const u_int*	slot;		// next member to restore
+	    u_int		arr;		// counted array being restored
+	    u_int		elm;		// next element of the array
+	    u_int		end;		// end of the array
+	};
+
+	bool		read(Object* parent, u_int slot)	;
+
+	std::istream&		_in;
+	Ptr<Object>		_obj;		// root of restored objects
+	std::vector<Frame>	_stack;		// objects with members pending
+	bool			_started;
+    };
+
+    virtual		~Object()		{}
     void*		operator new(size_t)	;
     void		operator delete(void*)	{}
+    static u_int	collect()		;
+    static u_int	finalize(u_int max=~0u)	;
+    static void		startFinalizer()	;
+    static void		stopFinalizer()		;
 
     bool		null()		const	{return (this == 0);}
     bool		consp()		const	{return !null() && iscons();}
     std::ostream&	save(std::ostream&)	const	;
+    std::future<bool>	snapshot(const char* file)	const	;
 
   protected:
+    void*		operator new(size_t, void* p)	{return p;}
+    static void*	allocate(size_t size, u_int& n)	;
+    static void*	newFinalizable(size_t size)	;
+    static size_t	cellsize(size_t size)		;
     virtual bool	iscons()		const	{return false;}
     virtual void	saveGuts(std::ostream&)	const	{}
     virtual void	restoreGuts(std::istream&)	{}
     Object*		copyObject(u_int)	const	;
+    Object*		parallelCopyObject(u_int nthreads) const	;
     static Object*	restoreObject(std::istream&)	;
     
   private:
+    Object*&		slot(u_int i)		{return ((Object**)this)[i];}
+    Object*		slot(u_int i)	const	{return ((Object* const*)this)[i];}
     void		mark()		const	;
+    void		mark(const Desc& desc)	const	;
+    const Desc&		classDesc()	const	;
+    const Desc&		currentDesc()	const	;
     virtual const Desc&	desc()		const	= 0;
     virtual Object*	clone()		const	= 0;
 
     friend void		PtrBase::mark();	// allow access to mark()
+    friend class	WeakBase;		// allow access to header
+    friend class	WeakTable;		// allow access to mark()
+    friend class	Finalizer;		// allow access to mark()
+    friend class	HeapProfiler;		// allow access to desc
+    friend class	PersistentHeap;		// allow access to mark()
+    friend class	StackScanner;		// allow access to mark()
     friend class	SaveMap;		// allow access to header
     friend class	CopyMap;		// allow access to header
+    friend class	CellBatch;		// allow access to allocate()
 };
 
+//! オブジェクトの全てのポインタメンバのword indexを関数に渡す
+/*!
+  ポインタメンバが全て先頭から64 words以内にあれば，それらの位置を表す
+  bitmapを走査するだけの直線的なコードとなる．要素数を伴う配列があれば，
+  続いてそれらの有効な要素のword indexが渡される．
+  \param obj	オブジェクト．
+  \param f	word index を引数とする関数．
+*/
+template <class F> inline void
+Object::Desc::trace(const Object* obj, F f) const
+{
+    if (_wide)
+	for (const u_int* s = &_slot[0]; *s != 0; ++s)
+	    f(*s);
+    else
+	for (u_long bm = _bm; bm != 0; bm &= bm - 1)
+	    f(__builtin_ctzl(bm));
+    for (u_int k = 0; k < _arr.size(); ++k)
+	for (u_int i = _arr[k].slot, end = i + count(obj, k); i < end; ++i)
+	    f(i);
+}
+
 #define DECLARE_COPY_AND_RESTORE(TYPE)					   \
     Ptr<TYPE >		copy()	const	{				   \
 					    Object* obj = copyObject(0);   \
 					    return Ptr<TYPE >((TYPE*)obj); \
 					}				   \
+    Ptr<TYPE >		copy(u_int n)	const				   \
+					{				   \
+					    Object* obj			   \
+						= parallelCopyObject(n);   \
+					    return Ptr<TYPE >((TYPE*)obj); \
+					}				   \
     static Ptr<TYPE >	restore(std::istream& in)			   \
 					{				   \
 					    Object* obj=restoreObject(in); \
@@ -153,6 +492,11 @@ class Object : private ObjectHeader
     static const Desc	_desc;						   \
     const Desc&		desc()		const	{return _desc;}
 
+#define DECLARE_FINALIZABLE						   \
+    void*		operator new(size_t size)			   \
+					{return newFinalizable(size);}	   \
+    void		operator delete(void*)	{}
+
 #define DECLARE_CONSTRUCTORS(TYPE)					   \
     Object*		clone()		const	{return new TYPE(*this);}  \
     static Object*	newObject()		{return new TYPE;}
@@ -165,7 +509,10 @@ class Cons : public Object
 {
   public:
     static Ptr<Cons>	cons0(T* ca)		{return new Cons(ca, 0);}
+    template <class ITER>
+    static Ptr<Cons>	fromRange(ITER first, ITER last)	;
     Ptr<Cons>		cons(T* ca)		{return new Cons(ca, this);}
+    Ptr<Cons>		hcons(T* ca)		;
     T*			car()		const	{return (!null() ? _ca : 0);}
     Cons*		cdr()		const	{return (!null() ? _cd : 0);}
     const Cons*		nthcdr(int)	const	;
@@ -193,6 +540,8 @@ class Cons : public Object
     virtual bool	iscons()			const	{return true;}
 
   private:
+    static Ptr<Cons>	alloc(u_int n, Cons* tail)	;
+
     T*		_ca;
     Cons*	_cd;
 
@@ -200,6 +549,690 @@ class Cons : public Object
     DECLARE_CONSTRUCTORS(Cons<T>)
 };
 
+/************************************************************************
+*  class CdrList:	CDR-coded list storing runs of cars contiguously	*
+************************************************************************/
+/*!
+  最大NCARS個のcarを1つのオブジェクトに連続して格納するリスト．各runは
+  次のrun(_nx)または通常のconsセルからなる残りのリスト(_cd)に続く．
+  要素あたりのメモリは Cons の半分以下であり，辿る際にもポインタを追う
+  回数が少ない．リスト上の位置はCursorで表され，Cursorに対して
+  car/cdr/rplaca/rplacdを通常のconsセルと同様に適用できる．run の途中
+  で rplacd を行うと，そこでrunが打ち切られ，以降は通常のconsセルに
+  続くことになる．
+*/
+template <class T>
+class CdrList : public Object
+{
+  public:
+    enum		{NCARS = 14};	// max. # of cars in a run
+
+    class Cursor
+    {
+      public:
+	Cursor(CdrList* run=0, u_int i=0, Cons<T>* cns=0)
+	    :_run(run), _i(i), _cns(run != 0 ? 0 : cns)		{}
+
+	bool		consp()		const	{return _run != 0 ||
+							_cns->consp();}
+	T*		car()		const	{return (_run != 0 ?
+							 _run->_ca[_i] :
+							 _cns->car());}
+	Cursor		cdr()		const	;
+	Cursor&		rplaca(T* ca)		;
+	Cursor&		rplacd(Cons<T>* cd)	;
+	
+      private:
+	CdrList*	_run;			// current run (or 0)
+	u_int		_i;			// index in _run
+	Cons<T>*	_cns;			// current cell if not in a run
+    };
+
+    static Ptr<CdrList>	pack(const Cons<T>* list)	;
+    Ptr<Cons<T> >	unpack()		const	;
+    Cursor		begin()				{return nthcdr(0);}
+    Cursor		nthcdr(int)			;
+    T*			nth(int n)			{return nthcdr(n).car();}
+    int			length()		const	;
+    Cursor		member(const T*)		;
+
+    DECLARE_COPY_AND_RESTORE(CdrList<T>)
+
+  protected:
+    CdrList()	:_n(0), _nx(0), _cd(0)
+		{
+		    for (u_int i = 0; i < NCARS; ++i)
+			_ca[i] = 0;
+		}
+
+    void		saveGuts(std::ostream& out) const
+			{out.write((const char*)&_n, sizeof(_n));}
+    void		restoreGuts(std::istream& in)
+			{in.read((char*)&_n, sizeof(_n));}
+    
+  private:
+    u_int	_n;			// # of cars in this run
+    T*		_ca[NCARS];
+    CdrList*	_nx;			// next run
+    Cons<T>*	_cd;			// rest of the list in ordinary cells
+
+    DECLARE_DESC
+    DECLARE_CONSTRUCTORS(CdrList<T>)
+};
+
+/************************************************************************
+*  class Array:		fixed-size array of pointers to objects		*
+************************************************************************/
+/*!
+  生成時に要素数が決まるポインタ配列．要素はオブジェクトの末尾に連続して
+  置かれ，GC，保存および複製の対象となる．Vector や HashMap の格納領域と
+  して用いられる．要素数は1つのpageに収まる範囲に限られる．256未満の
+  クラスIDはライブラリが使用する．
+
+  この制限を越える格納領域のために，葉となる Array を要素とするspineに
+  よる2段の構成を createSpine(), capacity(), at() で扱う．葉は全て
+  LEAFSIZ 個の要素を持つか，spineがLEAFSIZ個以下の要素からなる葉を1つ
+  だけ持つかのいずれかである．
+*/
+class Array : public Object
+{
+  public:
+    enum		{id_Array = 1};
+    enum		{LEAFSIZ = 4096};	//!< 2段構成の葉の要素数
+    
+    static Ptr<Array>	create(u_int n)		{return new(n) Array(n);}
+    static Ptr<Array>	createSpine(u_int n, const Array* spine=0)	;
+    static u_int	capacity(const Array* spine)
+			{
+			    return (spine != 0 ?
+				    spine->_n * leaf(spine, 0)->_n : 0);
+			}
+    static Object*&	at(const Array* spine, u_int i)
+			{
+			    return leaf(spine, i / LEAFSIZ)->_p[i % LEAFSIZ];
+			}
+    u_int		size()		const	{return _n;}
+    Object*&		operator [](u_int i)	{return _p[i];}
+    Object*		operator [](u_int i) const {return _p[i];}
+
+    DECLARE_COPY_AND_RESTORE(Array)
+
+  protected:
+    void*		operator new(size_t size, u_int n)
+			{
+			    return Object::operator new(
+					size + (n > 1 ? n - 1 : 0)*sizeof(Object*));
+			}
+
+  private:
+    Array(u_int n)	:_n(n)
+			{
+			    for (u_int i = 0; i < _n; ++i)
+				_p[i] = 0;
+			}
+    Array(const Array& a)
+	:Object(a), _n(a._n)
+			{
+			    for (u_int i = 0; i < _n; ++i)
+				_p[i] = a._p[i];
+			}
+
+    Object*		clone()		const	{return new(_n) Array(*this);}
+    static Object*	newObject(u_int n)	{return new(n) Array(n);}
+    static Array*	leaf(const Array* spine, u_int k)
+			{
+			    return static_cast<Array*>(spine->_p[k]);
+			}
+    
+    u_int		_n;
+    Object*		_p[1];			// actually _p[_n]
+
+    DECLARE_DESC
+};
+
+/************************************************************************
+*  class Vector:	growable array of pointers to objects		*
+************************************************************************/
+/*!
+  要素は Array::createSpine() による2段の格納領域に置かれるので，要素数
+  は1つのpageに収まる Array の大きさに制限されない．拡張の際は，既に
+  一杯になった葉は複写されずに新しいspineに引き継がれる．
+*/
+template <class T>
+class Vector : public Object
+{
+  public:
+    static Ptr<Vector>	create(u_int n=0)	;
+    u_int		size()		const	{return _n;}
+    bool		empty()		const	{return _n == 0;}
+    u_int		capacity()	const	{return Array::capacity(_a);}
+    T*&			operator [](u_int i)	{return (T*&)Array::at(_a, i);}
+    T*			operator [](u_int i) const {return (T*)Array::at(_a, i);}
+    void		reserve(u_int n)	;
+    void		resize(u_int n)		;
+    void		push_back(T* x)		;
+    void		pop_back()		;
+    void		clear()			{resize(0);}
+
+    DECLARE_COPY_AND_RESTORE(Vector<T>)
+
+  protected:
+    Vector()	:_n(0), _a(0)			{}
+
+    void		saveGuts(std::ostream& out) const
+			{out.write((const char*)&_n, sizeof(_n));}
+    void		restoreGuts(std::istream& in)
+			{in.read((char*)&_n, sizeof(_n));}
+    
+  private:
+    u_int		_n;			// # of elements
+    Array*		_a;			// spine of the storage
+
+    DECLARE_DESC
+    DECLARE_CONSTRUCTORS(Vector<T>)
+};
+
+/************************************************************************
+*  class HashMap:	hash table mapping objects to objects		*
+************************************************************************/
+/*!
+  キーとなるオブジェクトの同一性(アドレス)によって値を引く開番地法の
+  ハッシュ表．キーと値は Array::createSpine() による2段の格納領域に交互
+  に格納されるので，エントリ数は1つのpageに収まる Array の大きさに制限
+  されない．複製や復元によってキーのアドレスが変わった場合は，次に
+  アクセスした時に再ハッシュされる．
+*/
+template <class K, class V>
+class HashMap : public Object
+{
+  public:
+    static Ptr<HashMap>	create()		{return new HashMap;}
+    u_int		size()		const	{return _n;}
+    bool		empty()		const	{return _n == 0;}
+    V*			find(const K* key) const	;
+    void		insert(K* key, V* val)		;
+    bool		erase(const K* key)		;
+    void		clear()			{_n = 0; _a = 0;}
+    template <class F>
+    void		forEach(F f)	const	;
+
+    DECLARE_COPY_AND_RESTORE(HashMap)
+
+  protected:
+    HashMap()	:_n(0), _a(0), _dirty(false)	{}
+    HashMap(const HashMap& m)
+	:Object(m), _n(m._n), _a(m._a), _dirty(true)	{}
+
+    void		saveGuts(std::ostream& out) const
+			{out.write((const char*)&_n, sizeof(_n));}
+    void		restoreGuts(std::istream& in)
+			{
+			    in.read((char*)&_n, sizeof(_n));
+			    _dirty = true;
+			}
+    
+  private:
+    u_int		capacity()	const	{return Array::capacity(_a)/2;}
+    Object*&		slot(u_int j)	const	{return Array::at(_a, j);}
+    u_int		hash(const K* key) const
+			{
+			    u_long	h = u_long(key) * 0x9e3779b97f4a7c15ul;
+			    return u_int(h >> 32) & (capacity() - 1);
+			}
+    u_int		lookup(const K* key)	const	;
+    void		rehash(u_int cap)		;
+    void		update()		const
+			{
+			    if (_dirty)
+				const_cast<HashMap*>(this)->rehash(capacity());
+			}
+    
+    u_int		_n;			// # of entries
+    Array*		_a;			// spine of keys and values
+    bool		_dirty;			// needs rehashing?
+
+    DECLARE_DESC
+    DECLARE_CONSTRUCTORS(HashMap)
+};
+
+/************************************************************************
+*  class WeakBase:	abstract weak reference not protecting the	*
+*			object from GC					*
+*  class WeakPtr<T>:	weak pointer to "T" derived from "Object"	*
+************************************************************************/
+/*!
+  GCの根とはならないポインタ．markの後，sweepの前に，印の付かなかった
+  オブジェクトを指すものは全て0にされる．登録のためのリンクを持つので，
+  GCが管理するオブジェクトのメンバとしてではなく，スタックやC++のheap
+  上で用いること．
+*/
+class WeakBase
+{
+  public:
+    WeakBase(const WeakBase& q)	:_p(q._p)		{link();}
+    WeakBase&	operator =(const WeakBase& q)		{_p=q._p;return *this;}
+    
+    bool	expired()			const	{return _p == 0;}
+    
+  protected:
+    WeakBase(Object* obj)	:_p(obj)		{link();}
+    ~WeakBase()						{unlink();}
+
+    Object*		_p;
+
+  private:
+    void		link()
+			{
+			    _prv = 0;
+			    _nxt = _root;
+			    if (_root != 0)
+				_root->_prv = this;
+			    _root = this;
+			}
+    void		unlink()
+			{
+			    if (_prv != 0)
+				_prv->_nxt = _nxt;
+			    else
+				_root = _nxt;
+			    if (_nxt != 0)
+				_nxt->_prv = _prv;
+			}
+    static void		clear()			;
+    static void		release(const void* begin, const void* end)	;
+
+    WeakBase*		_prv;
+    WeakBase*		_nxt;
+    static WeakBase*	_root;			// list of all weak pointers
+
+    friend class	Object;			// allow access to clear()
+    friend class	RegionScope;		// allow access to release()
+};
+
+template <class T>	class WeakPtr : public WeakBase
+{
+  public:
+		WeakPtr(T* obj=0)	:WeakBase(obj)	{}
+
+    WeakPtr&	operator = (T* obj)			{_p=obj; return *this;}
+    T*		get()				const	{return (T*)_p;}
+    Ptr<T>	lock()				const	{return get();}
+};
+
+/************************************************************************
+*  class WeakTable:	abstract table with weak keys			*
+*  class WeakMap<K, V>:	hash table mapping objects weakly to objects	*
+************************************************************************/
+/*!
+  キーを弱く，値を強く参照する表の基底クラス．値はキーが他から到達可能
+  な間だけ生かされ(ephemeron)，キーが回収されるとエントリごと削除される．
+  したがって値からキーを参照していてもキーが生き続けることはない．
+*/
+class WeakTable
+{
+  protected:
+    WeakTable()					{link();}
+    WeakTable(const WeakTable&)			{link();}
+    WeakTable&		operator =(const WeakTable&)	{return *this;}
+    virtual		~WeakTable()		{unlink();}
+
+    static bool		marked(const Object* obj)	;
+    static bool		mark(const Object* obj)		;
+    static bool		within(const void* obj,
+			       const void* begin, const void* end)
+			{
+			    return begin <= obj && obj < end;
+			}
+
+  private:
+  //! キーが生きているエントリの値に印を付け，新たに付けたらtrueを返す
+    virtual bool	markValues()		= 0;
+  //! キーが回収されるエントリを削除する
+    virtual void	removeDead()		= 0;
+  //! キーまたは値が指定された範囲にあるエントリを削除する
+    virtual void	release(const void* begin, const void* end)	= 0;
+
+    void		link()
+			{
+			    _prv = 0;
+			    _nxt = _root;
+			    if (_root != 0)
+				_root->_prv = this;
+			    _root = this;
+			}
+    void		unlink()
+			{
+			    if (_prv != 0)
+				_prv->_nxt = _nxt;
+			    else
+				_root = _nxt;
+			    if (_nxt != 0)
+				_nxt->_prv = _prv;
+			}
+    static void		markAll()		;
+    static void		clearAll()		;
+    static void		releaseAll(const void* begin, const void* end)	;
+
+    WeakTable*		_prv;
+    WeakTable*		_nxt;
+    static WeakTable*	_root;			// list of all weak tables
+
+    friend class	Object;			// allow access to markAll() etc.
+    friend class	RegionScope;		// allow access to releaseAll()
+};
+
+template <class K, class V>
+class WeakMap : public WeakTable
+{
+  private:
+    typedef std::unordered_map<const K*, V*>	Map;
+    
+  public:
+    u_int		size()		const	{return _map.size();}
+    bool		empty()		const	{return _map.empty();}
+    V*			find(const K* key) const
+			{
+			    typename Map::const_iterator
+					i = _map.find(key);
+			    return (i != _map.end() ? i->second : 0);
+			}
+    void		insert(K* key, V* val)	{_map[key] = val;}
+    bool		erase(const K* key)	{return _map.erase(key) != 0;}
+    void		clear()			{_map.clear();}
+
+  private:
+    bool		markValues()		;
+    void		removeDead()		;
+    void		release(const void* begin, const void* end)	;
+    
+    Map			_map;
+};
+
+/************************************************************************
+*  class InternTable<KEY, T>:	weak table of unique objects		*
+************************************************************************/
+/*!
+  値(KEY)から，その値を持つ唯一のオブジェクトを引く表(hash-consing)．
+  オブジェクトは弱く参照されるので，他から到達不能になればエントリごと
+  削除される．登録されたオブジェクトは共有されるので変更してはならない．
+  その代わり，同じ値を持つかどうかはポインタの比較で判定できる．
+*/
+template <class KEY, class T, class HASH=std::hash<KEY> >
+class InternTable : public WeakTable
+{
+  private:
+    typedef std::unordered_map<KEY, T*, HASH>	Map;
+    
+  public:
+    u_int		size()		const	{return _map.size();}
+    T*			find(const KEY& key) const
+			{
+			    typename Map::const_iterator
+					i = _map.find(key);
+			    return (i != _map.end() ? i->second : 0);
+			}
+    template <class F>
+    T*			intern(const KEY& key, F create)	;
+
+  private:
+    bool		markValues()		{return false;}
+    void		removeDead()		;
+    void		release(const void* begin, const void* end)	;
+    
+    Map			_map;
+};
+
+/************************************************************************
+*  class RegionScope:	scoped region for short-lived objects		*
+************************************************************************/
+/*!
+  生存中は，Object::operator new および Object::allocate によるオブジェ
+  クトを，GCの管理するpageではなく専用の領域から先頭から順に切り出す．
+  スコープを抜けると領域内の全てのオブジェクトは一度に解放され，markも
+  sweepも要しない．領域はGCの管理しない専用のpage単位で拡張され，閉じら
+  れたpageは次の領域のために再利用される．領域内のオブジェクトへのポイ
+  ンタをスコープの外に持ち出してはならない(TUObjectPP_DEBUG が定義され
+  ていれば検査される)．領域内のオブジェクトから辿れる領域外のオブジェ
+  クトは，領域内のオブジェクトが根から到達可能である限りGCから保護され
+  る．領域内のオブジェクトを指す弱いポインタは0にされ，WeakMap や
+  InternTable のエントリは削除される．入れ子にできる．
+*/
+class RegionScope
+{
+  public:
+    RegionScope()					;
+    ~RegionScope()					;
+
+  private:
+    struct Chunk
+    {
+	char*	begin;
+	char*	top;				// next free byte
+	char*	end;
+    };
+
+    RegionScope(const RegionScope&)			;
+    RegionScope&	operator =(const RegionScope&)	;
+    void*		operator new(size_t)		; // prohibit heap allocation
+
+    void*		allocate(u_int nblocks)		;
+    static void		unmark()			;
+    static u_int	unmark(const std::vector<Chunk>& chunks)	;
+    
+    std::vector<Chunk>	_chunks;
+    RegionScope* const	_prv;			// enclosing scope
+    static RegionScope*	_cur;			// innermost scope
+
+    friend class	Object;			// allow access to allocate()
+    friend class	StackScanner;		// allow access to _chunks
+};
+
+/************************************************************************
+*  class HeapProfiler:	sampling profiler of object allocations		*
+************************************************************************/
+/*!
+  平均 interval byte の割合でオブジェクトの確保を抽出し，呼び出し元の
+  スタックトレース，要求byte数およびクラスIDを記録する．抽出されたオブ
+  ジェクトがその後のGCを何回生き延びたかも記録される．抽出していない時
+  の Object::operator new への負荷は，1回の減算と比較のみである．
+  結果はgperftoolsのheap profile形式(pprofで読める)，またはクラス毎の
+  集計として出力される．死んだ抽出結果はスタックトレース毎およびクラス
+  毎の集計に畳み込まれるので，記録に要するメモリとGC毎の走査の手間は
+  生存中の抽出結果の数に比例する．
+*/
+class HeapProfiler
+{
+  public:
+    static void		start(size_t interval=512*1024)	;
+    static void		stop()				;
+    static void		dump(std::ostream& out)		;
+    static void		dumpByClass(std::ostream& out)	;
+
+  private:
+    enum		{MAXDEPTH = 32};
+
+    struct Sample
+    {
+	const Object*	obj;			// sampled object, still alive
+	size_t		size;			// requested # of bytes
+	u_int		ngc;			// # of GCs survived
+	u_int		depth;			// # of frames in pc[]
+	void*		pc[MAXDEPTH];		// stack trace
+    };
+
+  //! 死んだ抽出結果の集計
+    struct Stat
+    {
+	u_long		alloc;			// # of samples
+	u_long		allocBytes;		// # of requested bytes
+	u_long		ngc;			// total # of GCs survived
+    };
+    typedef std::map<std::vector<void*>, Stat>	StackStats;
+    typedef std::map<u_short, Stat>		ClassStats;
+    
+    static void		count(const void* p, size_t size)
+			{
+			    if ((_countdown -= long(size)) < 0)
+				sample(p, size);
+			}
+    static void		sample(const void* p, size_t size)	;
+    static void		scan()					;
+    static void		release(const void* begin, const void* end)	;
+    static u_short	classID(const Sample& s)		;
+    static void		retire(const Sample& s)		;
+    static void		reset()					;
+    
+    static long			_countdown;	// bytes to the next sample
+    static size_t		_interval;	// mean sampling interval
+    static std::vector<Sample>	_samples;	// live samples only
+    static StackStats		_byStack;	// dead samples per stack
+    static ClassStats		_byClass;	// dead samples per class
+
+    friend class	Object;			// allow access to count()
+    friend class	RegionScope;		// allow access to release()
+};
+
+/************************************************************************
+*  class PersistentHeap:	heap kept in a memory-mapped file	*
+************************************************************************/
+/*!
+  open() 以後に確保されるpageを，固定アドレスに写像したファイルから切り
+  出す．ファイルには名前付きの根の表も置かれるので，次にプロセスが同じ
+  ファイルを開けば，保存や復元を要さずに直ちに以前のオブジェクトグラフ
+  を根から辿ることができる．再び開く際にはファイルに記録されたクラス毎
+  のメンバ配置を現在の記述子と照合し，各オブジェクトのvtableへのポイン
+  タをクラスIDから張り直す．
+
+  open() はオブジェクトを確保する前に呼ばなければならない．ファイルの
+  内容は sync() を呼んだ時点のものが次回に引き継がれる．弱参照，
+  InternTable およびファイナライザへの登録は引き継がれない．
+
+  ヘッダの clean は sync() で立てられ，その後のGC，ファイルからのpage
+  の確保，ファイル中のcellのオブジェクトへの貸し出し，および根の登録の
+  いずれかで下ろされる．sync() せずにプロセスが終了したファイルには
+  クラスIDの記録されていないオブジェクトが残り得るので，open() はこれ
+  が下りているファイルを受け付けない．既存のオブジェクトのメンバの
+  書き換えだけでは下ろされないが，ファイルの構造は損なわれない．
+*/
+class PersistentHeap
+{
+  public:
+    static void		open(const char* path,
+			     size_t size=(size_t(1) << 30),
+			     void* base=(void*)0x6f0000000000)	;
+    static void		sync()					;
+    static bool		opened()		{return _hdr != 0;}
+    static Object*	root(const char* name)			;
+    static void		root(const char* name, const Object* obj)	;
+    
+  private:
+    enum		{NROOTS = 64, NAMELEN = 56,
+			 NCLASSES = (1 << ObjectHeader::CID_BITS)};
+
+    struct Root
+    {
+	char		name[NAMELEN];
+	Object*		obj;
+    };
+
+    struct Header
+    {
+	char		magic[8];
+	void*		base;			// address of the mapping
+	size_t		size;			// # of bytes of the mapping
+	u_int		npages;			// # of pages allocated
+	u_int		clean;			// unchanged since sync()?
+	Root		root[NROOTS];		// root directory
+	u_long		desc[NCLASSES];		// fingerprints of classes
+    };
+
+    static void*	allocate()				;
+    static bool		contains(const void* p)
+			{
+			    return (_hdr != 0 && p >= (const void*)_hdr &&
+				    (const char*)p < (const char*)_hdr
+						   + _hdr->size);
+			}
+    static void		touch(const void* p)
+			{
+			    if (contains(p))
+				_hdr->clean = false;
+			}
+    static void		mark()					;
+    static void		attach()				;
+
+    static Header*	_hdr;			// 0 if not opened
+    static bool		_attached;		// vptrs are valid
+    static bool		_prototyping;		// creating vtable prototypes
+
+    friend class	Object;			// allow access to mark() etc.
+    friend class	Page;			// allow access to allocate()
+};
+
+/************************************************************************
+*  class StackScanner:	conservative scanner of the stack for roots	*
+************************************************************************/
+/*!
+  走査中は，GCを行うスレッドのスタックとレジスタにある語のうち，GCの
+  管理するpageまたは開いている RegionScope の領域にある貸し出し中の
+  cellを指すもの(内部を指すものを含む)を根とみなす．これにより，その
+  スレッドでは Ptr に包まない生のポインタを確保をまたいで保持できる．
+  ただし，整数などをポインタと見誤ってゴミを残すことがある．他のスレッ
+  ドのスタックは走査されないので，そこでは引き続き Ptr を用いること．
+*/
+class StackScanner
+{
+  public:
+    static void		start()					;
+    static void		stop()					;
+    static bool		scanning()		{return _base != 0;}
+
+  private:
+    static void		mark()					;
+    static void		scan()					;
+
+    static const void*	_base;			// bottom of the stack
+    static std::thread::id	_tid;			// scanned thread
+
+    friend class	Object;			// allow access to mark()
+};
+
+/************************************************************************
+*  class ReadAheadBuf:	stream buffer prefetching its source in a	*
+*			background thread				*
+************************************************************************/
+class ReadAheadBuf : public std::streambuf
+{
+  public:
+    ReadAheadBuf(std::streambuf* src,
+		 size_t bufsiz=(1 << 20), u_int nbufs=4)	;
+    ReadAheadBuf(std::istream& in,
+		 size_t bufsiz=(1 << 20), u_int nbufs=4)	;
+    ~ReadAheadBuf()						;
+
+  protected:
+    int_type		underflow()				;
+
+  private:
+    ReadAheadBuf(const ReadAheadBuf&)				;
+    ReadAheadBuf&	operator =(const ReadAheadBuf&)		;
+
+    void		fetch()					;
+
+    std::streambuf* const		_src;
+    std::vector<std::vector<char> >	_buf;	// ring of buffers
+    std::vector<size_t>			_len;	// # of valid bytes
+    u_int				_head;	// next buffer to consume
+    u_int				_tail;	// next buffer to fill
+    u_int				_nfilled; // # of filled buffers
+    bool				_inuse;	// _buf[_head] in get area
+    bool				_eof;
+    bool				_quit;
+    std::mutex				_mtx;
+    std::condition_variable		_cond;
+    std::thread				_reader;
+};
+
 /************************************************************************
 *  some implementations							*
 ************************************************************************/
@@ -3,19 +3,52 @@
  */
 
 #include "Object++_.h"
+#include <climits>
 
 namespace TU
 {
-PtrBase*		PtrBase::_root = 0;	// root of the all objects
+PtrBase::Root*		PtrBase::_stack = 0;	// roots of the all objects
+u_int			PtrBase::_top = 0;
+u_int			PtrBase::_size = 0;
+WeakBase*		WeakBase::_root = 0;	// root of weak pointers
+WeakTable*		WeakTable::_root = 0;	// root of weak tables
+RegionScope*		RegionScope::_cur = 0;	// innermost region
+long			HeapProfiler::_countdown = LONG_MAX;
+size_t			HeapProfiler::_interval = 0;	// not sampling
+std::vector<HeapProfiler::Sample>	HeapProfiler::_samples;
+HeapProfiler::StackStats		HeapProfiler::_byStack;
+HeapProfiler::ClassStats		HeapProfiler::_byClass;
+PersistentHeap::Header*	PersistentHeap::_hdr = 0;	// not opened
+bool			PersistentHeap::_attached = false;
+bool			PersistentHeap::_prototyping = false;
+const void*		StackScanner::_base = 0;	// not scanning
+std::thread::id		StackScanner::_tid;
 
 Page::Root		Page::_root;		// root of page list
-Page::Cell		Page::Cell::_head[];
+Page::Root		Page::_spare;		// unused region pages
+Page::Cell*		Page::Cell::_head[];
 
 u_int			Object::Desc::_ndescs = 0;
-Object::Desc::Map*	Object::Desc::_map = 0;
+Object::Desc**		Object::Desc::_tbl = 0;
+u_int			Object::Desc::_ntbl = 0;
+Object::Desc*		Object::Desc::_pending = 0;
 SaveMap::Map		SaveMap::_map;
 u_long			SaveMap::_maxID = 0;	// maxID of save table
 RestoreMap::Map		RestoreMap::_map;
 u_long			RestoreMap::_maxID = 0;	// maxID of restore table
 CopyMap::Map		CopyMap::_map;
+u_int			GCInhibitor::_n = 0;
+std::mutex		CellBatch::_mtx;
+thread_local CellBatch*	CellBatch::_cur = 0;	// not in a worker
+std::vector<Object*>	Finalizer::_objs;
+std::vector<Object*>	Finalizer::_queue;
+std::mutex		Finalizer::_mtx;
+std::condition_variable	Finalizer::_cond;
+std::thread		Finalizer::_thread;
+bool			Finalizer::_quit = false;
+Finalizer::Guard	Finalizer::_guard;	// must follow _thread
+
+const Object::Desc	Array::_desc(Array::id_Array, 0, Array::newObject,
+				     Object::Desc::trailing(&Array::_n,
+							    &Array::_p));
 }
@@ -11,6 +11,10 @@ namespace TU
 {
 const unsigned	id_Int  = 256;
 const unsigned	id_Cons = 257;
+const unsigned	id_CdrList = 258;
+const unsigned	id_Vector = 259;
+const unsigned	id_HashMap = 260;
+const unsigned	id_Handle = 261;
 
 /*
  *  class Int
@@ -19,16 +23,11 @@ class Int : public Object
 {
   public:
     static Ptr<Int>	newInt(int i)		{return new Int(i);}
+    static Ptr<Int>	intern(int i)		;
     int			value()		const	{return val;}
 
     DECLARE_COPY_AND_RESTORE(Int)
 
-  protected:
-    void		saveGuts(std::ostream& out) const
-			{out.write((const char*)&val, sizeof(val));}
-    void		restoreGuts(std::istream& in)
-			{in.read((char*)&val, sizeof(val));}
-    
   private:
     Int(int i = 0)	:val(i)			{}
 
@@ -38,13 +37,60 @@ class Int : public Object
     DECLARE_CONSTRUCTORS(Int)
 };
 
-const Object::Desc	Int::_desc(id_Int, 0, Int::newObject, MbrpEnd);
+/*
+ *  class Handle: finalizable object counting its destructions
+ */
+class Handle : public Object
+{
+  public:
+    static Ptr<Handle>	create()		{return new Handle;}
+    static int		nclosed()		{return _nclosed;}
+
+    DECLARE_FINALIZABLE
+
+  private:
+    Handle()					{}
+    ~Handle()					{++_nclosed;}
+
+    static int		_nclosed;
+
+    DECLARE_DESC
+    DECLARE_CONSTRUCTORS(Handle)
+};
+
+int			Handle::_nclosed = 0;
+const Object::Desc	Handle::_desc(id_Handle, 0, Handle::newObject);
+const Object::Desc	Int::_desc(id_Int, 0, Int::newObject,
+				Object::Desc::guts(&Int::val));
 template <>
 const Object::Desc	Cons<Int>::_desc(id_Cons, 0,
 					 Cons<Int>::newObject,
 					 &Cons<Int>::_ca,
-					 &Cons<Int>::_cd,
-					 MbrpEnd);
+					 &Cons<Int>::_cd);
+template <>
+const Object::Desc	CdrList<Int>::_desc(id_CdrList, 0,
+					    CdrList<Int>::newObject,
+					    Object::Desc::counted(
+						&CdrList<Int>::_n,
+						&CdrList<Int>::_ca),
+					    &CdrList<Int>::_nx,
+					    &CdrList<Int>::_cd);
+template <>
+const Object::Desc	Vector<Int>::_desc(id_Vector, 0,
+					   Vector<Int>::newObject,
+					   &Vector<Int>::_a);
+template <>
+const Object::Desc	HashMap<Int, Int>::_desc(id_HashMap, 0,
+						 HashMap<Int, Int>::newObject,
+						 &HashMap<Int, Int>::_a);
+
+//! 指定された値を持つ唯一のIntを返す
+Ptr<Int>
+Int::intern(int i)
+{
+    static InternTable<int, Int>	table;
+    return table.intern(i, [i](){return new Int(i);});
+}
 
 /*
  *  Output functions
@@ -118,14 +164,72 @@ sub()
 }
 
 #include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ *  PersistentHeap must be opened before any allocation, so it is
+ *  exercised in child processes running this program again.
+ */
+static int
+persistent(const char* mode, const char* path)
+{
+    using namespace	std;
+    using namespace	TU;
+
+    try
+    {
+	PersistentHeap::open(path, size_t(64) << 20);
+	if (mode[0] == 'w')			// write and sync
+	{
+	    Ptr<Cons<Int> >	list;
+	    for (int i = 3; i > 0; --i)
+		list = list->cons(Int::newInt(i));
+	    PersistentHeap::root("list", list);
+	    PersistentHeap::sync();
+	}
+	else if (mode[0] == 'd')		// change after sync
+	{
+	    Ptr<Cons<Int> >	list = (Cons<Int>*)PersistentHeap::root("list");
+	    PersistentHeap::sync();
+	    list->rplaca(Int::newInt(42));	// from the rebuilt free list
+	}
+	else					// read back
+	    cout << "Persistent:\t"
+		 << (Cons<Int>*)PersistentHeap::root("list") << endl;
+    }
+    catch (std::exception&)
+    {
+	cout << "Persistent:\trefused" << endl;
+    }
+    return 0;
+}
+
+static void
+spawn(const char* self, const char* mode, const char* path)
+{
+    std::cout.flush();
+    if (pid_t pid = fork())
+	waitpid(pid, 0, 0);
+    else
+    {
+	execl(self, self, mode, path, (char*)0);
+	_exit(1);
+    }
+}
 
 int
-main()
+main(int argc, char* argv[])
 {
     using namespace	std;
     using namespace	TU;
+
+    if (argc > 2)
+	return persistent(argv[1], argv[2]);
 	
     Ptr<Cons<Int> >	list = sub();
+    std::future<bool>	snap = list->snapshot("snap.dat");
     
     std::ofstream out("tmp.dat", ios::out);
     list->save(out);
@@ -134,8 +238,13 @@ main()
     list = list->append(list);
     cout << "Append:\t" << list << endl;
 
-    std::ifstream in("tmp.dat", ios::in);
-    list = Cons<Int>::restore(in);
+    std::ifstream	in("tmp.dat", ios::in);
+    ReadAheadBuf	buf(in, 64);
+    std::istream	ra(&buf);
+    Object::Restorer	restorer(ra);
+    for (int n = 1; !restorer(4); ++n)		// 4 objects per step
+	cerr << "Restoring step " << n << "..." << endl;
+    list = (Cons<Int>*)restorer.result();
 //    if (in.eof())
 //	cout << "End of File!" << endl;
     in.close();
@@ -143,6 +252,90 @@ main()
     Ptr<Cons<Int> > list2 = list->copy()->nreverse();
     cout << "Original:\t" << list  << endl;
     cout << "Clone:\t"    << list2 << endl;
+    Ptr<Cons<Int> > list3 = list->copy(4);		// copy with 4 threads
+    cout << "Parallel clone:\t" << list3 << endl;
+    Ptr<CdrList<Int> > packed = CdrList<Int>::pack(list);
+    packed->nthcdr(packed->length() - 3).rplacd(list2);
+    cout << "Packed:\t" << packed->unpack() << endl;
+    Ptr<CdrList<Int> > empty = CdrList<Int>::pack(0);
+    cout << "Packed empty:\t" << empty->length() << ' '
+	 << empty->begin().consp() << ' ' << empty->unpack() << endl;
+
+    Ptr<Vector<Int> >		vec = Vector<Int>::create();
+    Ptr<HashMap<Int, Int> >	sq  = HashMap<Int, Int>::create();
+    for (Cons<Int>* cns = list; cns->consp(); cns = cns->cdr())
+    {
+	vec->push_back(cns->car());
+	sq->insert(cns->car(), Int::newInt(cns->car()->value() *
+					   cns->car()->value()));
+    }
+    cout << "Squares:\t";
+    for (u_int i = 0; i < vec->size(); ++i)
+	cout << sq->find((*vec)[i]);
+    cout << endl;
+    sq->erase((*vec)[0]);
+    Ptr<HashMap<Int, Int> >	sq2 = sq->copy();	// keys are copied
+    cout << "Copied map:\t" << sq2->size() << " entries" << endl;
+
+    Ptr<Vector<Int> >		big = Vector<Int>::create();
+    Ptr<HashMap<Int, Int> >	idx = HashMap<Int, Int>::create();
+    for (int i = 0; i < 100000; ++i)		// beyond a single page
+    {
+	Ptr<Int>	x = Int::newInt(i);
+	big->push_back(x);
+	idx->insert(x, Int::newInt(-i));
+    }
+    Object::collect();
+    cout << "Large:\t" << big->size() << " elements, " << idx->size()
+	 << " entries, last " << idx->find((*big)[big->size() - 1]) << endl;
+    
+    Ptr<Cons<Int> >	h1 = 0, h2 = 0;
+    for (Cons<Int>* cns = list; cns->consp(); cns = cns->cdr())
+    {
+	h1 = h1->hcons(Int::intern(cns->car()->value()));
+	h2 = h2->hcons(Int::intern(cns->car()->value()));
+    }
+    cout << "Hash-consed:\t" << h1 << (h1 == h2 ? "(shared)" : "(not shared)")
+	 << endl;
+
+    Ptr<Cons<Int> >	moved(std::move(h1));	// h1 loses its root slot
+    h1 = Cons<Int>::cons0(Int::newInt(99));	// and gets it back
+    Object::collect();
+    for (int i = 0; i < 1000; ++i)		// Reuse freed cells if any.
+	Cons<Int>::cons0(Int::newInt(-1));
+    cout << "Moved:\t" << moved << "/ " << h1 << endl;
+
+    HeapProfiler::start(1024);			// sample every 1KB on average
+    for (int i = 0; i < 10000; ++i)
+	Cons<Int>::cons0(Int::newInt(i));
+    Object::collect();				// samples die and are folded
+    std::ostringstream	prof;
+    HeapProfiler::dump(prof);
+    HeapProfiler::stop();
+    cout << "Heap profile:\t"
+	 << (prof.str().compare(0, 13, "heap profile:") == 0 ? "dumped"
+							      : "failed")
+	 << endl;
+
+    for (int i = 0; i < 3; ++i)
+	Handle::create();			// garbage at once
+    Object::collect();				// queue them
+    Object::finalize();				// and run their destructors
+    cout << "Finalized:\t" << Handle::nclosed() << endl;
+
+    StackScanner::start();			// raw pointers are roots
+    Cons<Int>*	raw = list2->copy();
+    Object::collect();
+    cout << "Stack scanned:\t" << raw << endl;
+    StackScanner::stop();
+    
+    cout << "Snapshot:\t" << (snap.get() ? "saved" : "failed") << endl;
+
+    unlink("heap.dat");
+    spawn(argv[0], "w", "heap.dat");		// sync and exit
+    spawn(argv[0], "r", "heap.dat");		// reopen and read the root
+    spawn(argv[0], "d", "heap.dat");		// change after sync
+    spawn(argv[0], "r", "heap.dat");		// refused
 
     return 0;
 }    